@@ -0,0 +1,530 @@
+/*
+
+Copyright © 2012-2015 Elias Aebi
+
+All rights reserved.
+
+*/
+
+#include "infra.hpp"
+#include <EGL/egl.h>
+#include <EGL/eglext.h>
+#include <zlib.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+namespace infra {
+
+static double get_time () {
+	timespec t;
+	clock_gettime (CLOCK_MONOTONIC, &t);
+	return t.tv_sec + t.tv_nsec * 1e-9;
+}
+
+// HeadlessContext
+HeadlessContext::HeadlessContext (): display(NULL), context(NULL) {
+	
+}
+HeadlessContext::~HeadlessContext () {
+	if (context) {
+		eglMakeCurrent ((EGLDisplay)display, EGL_NO_SURFACE, EGL_NO_SURFACE, EGL_NO_CONTEXT);
+		eglDestroyContext ((EGLDisplay)display, (EGLContext)context);
+	}
+	if (display)
+		eglTerminate ((EGLDisplay)display);
+}
+bool HeadlessContext::create (Backend::Type backend) {
+	// prefer the surfaceless platform, it works without X or a GPU (llvmpipe)
+	EGLDisplay egl_display = EGL_NO_DISPLAY;
+	PFNEGLGETPLATFORMDISPLAYEXTPROC get_platform_display = (PFNEGLGETPLATFORMDISPLAYEXTPROC) eglGetProcAddress ("eglGetPlatformDisplayEXT");
+	if (get_platform_display)
+		egl_display = get_platform_display (EGL_PLATFORM_SURFACELESS_MESA, EGL_DEFAULT_DISPLAY, NULL);
+	if (egl_display == EGL_NO_DISPLAY)
+		egl_display = eglGetDisplay (EGL_DEFAULT_DISPLAY);
+	if (egl_display == EGL_NO_DISPLAY || !eglInitialize(egl_display, NULL, NULL)) {
+		fprintf (stderr, "HeadlessContext::create: failed to initialize EGL\n");
+		return false;
+	}
+	display = egl_display;
+	eglBindAPI (EGL_OPENGL_API);
+	
+	EGLint attributes[] = {EGL_RENDERABLE_TYPE, EGL_OPENGL_BIT, EGL_NONE};
+	EGLConfig config;
+	EGLint count = 0;
+	if (!eglChooseConfig(egl_display, attributes, &config, 1, &count) || count == 0) {
+		fprintf (stderr, "HeadlessContext::create: no OpenGL config available\n");
+		return false;
+	}
+	EGLContext egl_context = EGL_NO_CONTEXT;
+	if (backend == Backend::CORE) {
+		EGLint core_attributes[] = {EGL_CONTEXT_MAJOR_VERSION, 4, EGL_CONTEXT_MINOR_VERSION, 5, EGL_CONTEXT_OPENGL_PROFILE_MASK, EGL_CONTEXT_OPENGL_CORE_PROFILE_BIT, EGL_NONE};
+		egl_context = eglCreateContext (egl_display, config, EGL_NO_CONTEXT, core_attributes);
+		if (egl_context == EGL_NO_CONTEXT) {
+			fprintf (stderr, "HeadlessContext::create: no OpenGL 4.5 core profile (0x%x), falling back to the legacy backend\n", eglGetError());
+			backend = Backend::LEGACY;
+		}
+	}
+	if (egl_context == EGL_NO_CONTEXT)
+		egl_context = eglCreateContext (egl_display, config, EGL_NO_CONTEXT, NULL);
+	if (egl_context == EGL_NO_CONTEXT) {
+		fprintf (stderr, "HeadlessContext::create: failed to create a context (0x%x)\n", eglGetError());
+		return false;
+	}
+	context = egl_context;
+	// no surface, everything is rendered into framebuffer objects (EGL_KHR_surfaceless_context)
+	if (!eglMakeCurrent(egl_display, EGL_NO_SURFACE, EGL_NO_SURFACE, egl_context)) {
+		fprintf (stderr, "HeadlessContext::create: failed to make the context current (0x%x)\n", eglGetError());
+		return false;
+	}
+	printf ("HeadlessContext::create: %s, OpenGL %s\n", glGetString(GL_RENDERER), glGetString(GL_VERSION));
+	Backend::select (backend);
+	return true;
+}
+
+// BatchJob
+static bool ends_with (const char* string, const char* suffix) {
+	size_t length = strlen (string);
+	size_t suffix_length = strlen (suffix);
+	return length >= suffix_length && strcasecmp (string + length - suffix_length, suffix) == 0;
+}
+// the pattern is used as a printf format for the frame number, so it may only
+// contain %% and a single %d or %i with optional flags and width
+static bool valid_output_pattern (const char* pattern) {
+	int conversions = 0;
+	for (const char* c = pattern; *c; c++) {
+		if (*c != '%')
+			continue;
+		c++;
+		if (*c == '%')
+			continue;
+		while (*c == '0' || *c == '-' || *c == '+' || *c == ' ')
+			c++;
+		while (*c >= '0' && *c <= '9')
+			c++;
+		if (*c != 'd' && *c != 'i')
+			return false;
+		conversions++;
+	}
+	return conversions == 1;
+}
+struct EarlierKeyframe {
+	bool operator () (const BatchJob::Keyframe& k1, const BatchJob::Keyframe& k2) {
+		return k1.frame < k2.frame;
+	}
+};
+BatchJob::BatchJob (): format(PNG), width(1280), height(720), first_frame(0), last_frame(0), orbit(false), orbit_center(0.0f,0.0f,0.0f), orbit_radius(10.0f), orbit_height(0.0f), orbit_turns(1.0f) {
+	scene_file[0] = '\0';
+	output_pattern[0] = '\0';
+}
+bool BatchJob::load (const char* filename) {
+	FILE* file = fopen (filename, "r");
+	if (!file) {
+		fprintf (stderr, "BatchJob::load: failed to open %s\n", filename);
+		return false;
+	}
+	char line[512];
+	int line_number = 0;
+	while (fgets(line, sizeof(line), file)) {
+		line_number++;
+		char keyword[32];
+		if (sscanf(line, "%31s", keyword) != 1 || keyword[0] == '#')
+			continue;
+		Keyframe k;
+		bool valid = true;
+		if (strcmp(keyword, "scene") == 0)
+			valid = sscanf (line, "%*s %255s", scene_file) == 1;
+		else if (strcmp(keyword, "output") == 0)
+			valid = sscanf (line, "%*s %255s", output_pattern) == 1;
+		else if (strcmp(keyword, "resolution") == 0)
+			valid = sscanf (line, "%*s %d %d", &width, &height) == 2 && width > 0 && height > 0;
+		else if (strcmp(keyword, "frames") == 0)
+			valid = sscanf (line, "%*s %d %d", &first_frame, &last_frame) == 2 && last_frame >= first_frame;
+		else if (strcmp(keyword, "camera") == 0) {
+			valid = sscanf (line, "%*s %d %f %f %f %f %f %f", &k.frame, &k.position.x, &k.position.y, &k.position.z, &k.target.x, &k.target.y, &k.target.z) == 7;
+			if (valid) camera_path.append (k);
+		}
+		else if (strcmp(keyword, "orbit") == 0) {
+			valid = sscanf (line, "%*s %f %f %f %f %f %f", &orbit_center.x, &orbit_center.y, &orbit_center.z, &orbit_radius, &orbit_height, &orbit_turns) == 6;
+			orbit = valid;
+		}
+		else
+			fprintf (stderr, "BatchJob::load: %s:%d: unknown setting %s\n", filename, line_number, keyword);
+		if (!valid)
+			fprintf (stderr, "BatchJob::load: %s:%d: invalid %s\n", filename, line_number, keyword);
+	}
+	fclose (file);
+	
+	if (!scene_file[0] || !output_pattern[0]) {
+		fprintf (stderr, "BatchJob::load: %s needs a scene and an output\n", filename);
+		return false;
+	}
+	if (!valid_output_pattern(output_pattern)) {
+		fprintf (stderr, "BatchJob::load: the output %s needs exactly one %%d for the frame number\n", output_pattern);
+		return false;
+	}
+	if (ends_with(output_pattern, ".exr"))
+		format = EXR;
+	else if (ends_with(output_pattern, ".png"))
+		format = PNG;
+	else {
+		fprintf (stderr, "BatchJob::load: unsupported output format %s\n", output_pattern);
+		return false;
+	}
+	camera_path.sort (EarlierKeyframe());
+	return true;
+}
+void BatchJob::get_camera (int frame, vec3& position, vec3& target) const {
+	if (orbit) {
+		float t = (float)(frame - first_frame) / (last_frame - first_frame + 1);
+		float angle = 2.0f * M_PI * orbit_turns * t;
+		position = orbit_center + vec3 (sin(angle)*orbit_radius, orbit_height, cos(angle)*orbit_radius);
+		target = orbit_center;
+		return;
+	}
+	if (camera_path.count() == 0) {
+		position = vec3 (0.0f, 0.0f, 10.0f);
+		target = vec3 (0.0f, 0.0f, 0.0f);
+		return;
+	}
+	// linear interpolation between the surrounding keyframes
+	int i = 0;
+	while (i < camera_path.count()-1 && camera_path[i+1].frame <= frame)
+		i++;
+	const Keyframe& k1 = camera_path[i];
+	if (i == camera_path.count()-1 || frame <= k1.frame) {
+		position = k1.position;
+		target = k1.target;
+		return;
+	}
+	const Keyframe& k2 = camera_path[i+1];
+	float t = (float)(frame - k1.frame) / (k2.frame - k1.frame);
+	position = k1.position + (k2.position - k1.position) * t;
+	target = k1.target + (k2.target - k1.target) * t;
+}
+
+// image encoding
+static void put_uint32_big_endian (unsigned char* p, unsigned int value) {
+	p[0] = value >> 24;
+	p[1] = value >> 16;
+	p[2] = value >> 8;
+	p[3] = value;
+}
+static void write_png_chunk (FILE* file, const char* type, const unsigned char* data, unsigned int size) {
+	unsigned char header[8];
+	put_uint32_big_endian (header, size);
+	memcpy (header + 4, type, 4);
+	fwrite (header, 1, 8, file);
+	fwrite (data, 1, size, file);
+	unsigned char crc[4];
+	uLong checksum = crc32 (crc32(0, NULL, 0), header+4, 4);
+	if (size > 0)
+		checksum = crc32 (checksum, data, size);
+	put_uint32_big_endian (crc, checksum);
+	fwrite (crc, 1, 4, file);
+}
+static bool write_png (const char* filename, const unsigned char* pixels, int width, int height) {
+	// every row starts with its filter type (none), OpenGL stores the bottom row first
+	size_t row_size = width * 4;
+	size_t raw_size = (row_size + 1) * height;
+	unsigned char* raw = (unsigned char*) malloc (raw_size);
+	for (int y=0; y<height; y++) {
+		raw[y*(row_size+1)] = 0;
+		memcpy (raw + y*(row_size+1) + 1, pixels + (height-1-y)*row_size, row_size);
+	}
+	uLongf compressed_size = compressBound (raw_size);
+	unsigned char* compressed = (unsigned char*) malloc (compressed_size);
+	int result = compress2 (compressed, &compressed_size, raw, raw_size, Z_BEST_SPEED);
+	free (raw);
+	if (result != Z_OK) {
+		fprintf (stderr, "write_png: compression failed for %s (%d)\n", filename, result);
+		free (compressed);
+		return false;
+	}
+	
+	FILE* file = fopen (filename, "wb");
+	if (!file) {
+		fprintf (stderr, "write_png: failed to open %s\n", filename);
+		free (compressed);
+		return false;
+	}
+	const unsigned char signature[] = {0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n'};
+	fwrite (signature, 1, 8, file);
+	unsigned char ihdr[13];
+	put_uint32_big_endian (ihdr, width);
+	put_uint32_big_endian (ihdr + 4, height);
+	ihdr[8] = 8; // bit depth
+	ihdr[9] = 6; // RGBA
+	ihdr[10] = 0;
+	ihdr[11] = 0;
+	ihdr[12] = 0;
+	write_png_chunk (file, "IHDR", ihdr, 13);
+	write_png_chunk (file, "IDAT", compressed, compressed_size);
+	write_png_chunk (file, "IEND", NULL, 0);
+	fclose (file);
+	free (compressed);
+	return true;
+}
+// the EXR header and scanline data are little-endian like the host
+static void write_exr_attribute (FILE* file, const char* name, const char* type, const void* data, int size) {
+	fwrite (name, 1, strlen(name)+1, file);
+	fwrite (type, 1, strlen(type)+1, file);
+	fwrite (&size, 4, 1, file);
+	fwrite (data, 1, size, file);
+}
+static bool write_exr (const char* filename, const float* pixels, int width, int height) {
+	FILE* file = fopen (filename, "wb");
+	if (!file) {
+		fprintf (stderr, "write_exr: failed to open %s\n", filename);
+		return false;
+	}
+	// single part scanline file, uncompressed 32-bit float channels
+	int magic[] = {20000630, 2};
+	fwrite (magic, 4, 2, file);
+	
+	// the channels in alphabetical order
+	const char* channel_names[] = {"A", "B", "G", "R"};
+	const int channel_offsets[] = {3, 2, 1, 0};
+	unsigned char channels[4*18+1];
+	int size = 0;
+	for (int c=0; c<4; c++) {
+		channels[size++] = channel_names[c][0];
+		channels[size++] = '\0';
+		int channel[] = {2, 0, 1, 1}; // FLOAT, pLinear and reserved, x and y sampling
+		memcpy (channels + size, channel, 16);
+		size += 16;
+	}
+	channels[size++] = '\0';
+	write_exr_attribute (file, "channels", "chlist", channels, size);
+	unsigned char compression = 0;
+	write_exr_attribute (file, "compression", "compression", &compression, 1);
+	int window[] = {0, 0, width-1, height-1};
+	write_exr_attribute (file, "dataWindow", "box2i", window, 16);
+	write_exr_attribute (file, "displayWindow", "box2i", window, 16);
+	unsigned char line_order = 0; // increasing y
+	write_exr_attribute (file, "lineOrder", "lineOrder", &line_order, 1);
+	float aspect_ratio = 1.0f;
+	write_exr_attribute (file, "pixelAspectRatio", "float", &aspect_ratio, 4);
+	float center[] = {0.0f, 0.0f};
+	write_exr_attribute (file, "screenWindowCenter", "v2f", center, 8);
+	float window_width = 1.0f;
+	write_exr_attribute (file, "screenWindowWidth", "float", &window_width, 4);
+	fputc ('\0', file);
+	
+	// the offset table, followed by one chunk per scanline
+	int data_size = width * 4 * sizeof(float);
+	unsigned long long offset = ftell(file) + height * sizeof(unsigned long long);
+	for (int y=0; y<height; y++) {
+		fwrite (&offset, 8, 1, file);
+		offset += 8 + data_size;
+	}
+	float* line = (float*) malloc (data_size);
+	for (int y=0; y<height; y++) {
+		const float* row = pixels + (height-1-y) * width * 4;
+		for (int c=0; c<4; c++)
+			for (int x=0; x<width; x++)
+				line[c*width + x] = row[x*4 + channel_offsets[c]];
+		fwrite (&y, 4, 1, file);
+		fwrite (&data_size, 4, 1, file);
+		fwrite (line, 1, data_size, file);
+	}
+	free (line);
+	fclose (file);
+	return true;
+}
+
+// BatchRenderer
+struct BatchFrame {
+	char filename[256];
+	void* pixels;
+};
+struct EncoderQueue {
+	pthread_mutex_t mutex;
+	pthread_cond_t frame_available;
+	pthread_cond_t space_available;
+	List<BatchFrame*> frames;
+	bool done;
+	int encoded;
+	int failed;
+	const BatchJob* job;
+};
+static void* encoder_worker (void* argument) {
+	EncoderQueue* queue = (EncoderQueue*) argument;
+	while (true) {
+		pthread_mutex_lock (&queue->mutex);
+		while (queue->frames.count() == 0 && !queue->done)
+			pthread_cond_wait (&queue->frame_available, &queue->mutex);
+		if (queue->frames.count() == 0) {
+			pthread_mutex_unlock (&queue->mutex);
+			return NULL;
+		}
+		BatchFrame* frame = queue->frames[0];
+		queue->frames.remove (0);
+		pthread_cond_signal (&queue->space_available);
+		pthread_mutex_unlock (&queue->mutex);
+		
+		const BatchJob* job = queue->job;
+		bool success;
+		if (job->format == BatchJob::EXR)
+			success = write_exr (frame->filename, (float*)frame->pixels, job->width, job->height);
+		else
+			success = write_png (frame->filename, (unsigned char*)frame->pixels, job->width, job->height);
+		free (frame->pixels);
+		delete frame;
+		
+		pthread_mutex_lock (&queue->mutex);
+		queue->encoded++;
+		if (!success) queue->failed++;
+		pthread_mutex_unlock (&queue->mutex);
+	}
+}
+BatchRenderer::BatchRenderer (int encoder_threads, int readback_buffers, int max_queued_frames): encoder_threads(encoder_threads), readback_buffers(readback_buffers), max_queued_frames(max_queued_frames), frames_rendered(0), frames_encoded(0), seconds(0.0), fps(0.0), max_queue_depth(0), average_queue_depth(0.0f), encoder_stalls(0) {
+	
+}
+bool BatchRenderer::run (const BatchJob& job) {
+	frames_rendered = 0;
+	frames_encoded = 0;
+	max_queue_depth = 0;
+	average_queue_depth = 0.0f;
+	encoder_stalls = 0;
+	
+	// every frame has to be final, so the textures are not streamed
+	bool streaming = TextureStreamer::enabled;
+	TextureStreamer::enabled = false;
+	Object object (job.scene_file);
+	TextureStreamer::enabled = streaming;
+	if (object.meshes.count() == 0) {
+		fprintf (stderr, "BatchRenderer::run: nothing to render in %s\n", job.scene_file);
+		return false;
+	}
+	Scene scene;
+	Instance instance (&object);
+	scene.add (&instance);
+	scene.precompile ();
+	Instance target (NULL);
+	Camera camera (&scene, job.width, job.height);
+	camera.track = &target;
+	
+	bool hdr = job.format == BatchJob::EXR;
+	GLenum texture_format = hdr ? GL_RGBA32F : GL_RGBA8;
+	FramebufferObject framebuffer (job.width, job.height, texture_format);
+	size_t frame_size = (size_t)job.width * job.height * (hdr ? 4*sizeof(float) : 4);
+	int slots = readback_buffers > 1 ? readback_buffers : 1;
+	Buffer** pixel_buffers = new Buffer*[slots];
+	GLsync* fences = new GLsync[slots];
+	int* slot_frames = new int[slots];
+	for (int i=0; i<slots; i++) {
+		pixel_buffers[i] = new Buffer (frame_size, GL_PIXEL_PACK_BUFFER, GL_STREAM_READ, "BatchRenderer readback");
+		fences[i] = NULL;
+	}
+	
+	EncoderQueue queue;
+	pthread_mutex_init (&queue.mutex, NULL);
+	pthread_cond_init (&queue.frame_available, NULL);
+	pthread_cond_init (&queue.space_available, NULL);
+	queue.done = false;
+	queue.encoded = 0;
+	queue.failed = 0;
+	queue.job = &job;
+	int thread_count = encoder_threads > 1 ? encoder_threads : 1;
+	pthread_t* threads = new pthread_t[thread_count];
+	for (int i=0; i<thread_count; i++)
+		pthread_create (&threads[i], NULL, encoder_worker, &queue);
+	
+	int frame_count = job.last_frame - job.first_frame + 1;
+	double start = get_time ();
+	double last_report = start;
+	double queue_depth_sum = 0.0;
+	// frame i is read back into slot i%slots and collected when the slot is
+	// reused, so up to slots frames are in flight on the GPU
+	for (int i=0; i<frame_count+slots; i++) {
+		int slot = i % slots;
+		if (fences[slot]) {
+			// wait for the GPU to finish this frame, then copy it out so the
+			// buffer can be reused immediately
+			while (glClientWaitSync(fences[slot], GL_SYNC_FLUSH_COMMANDS_BIT, 1000000000) == GL_TIMEOUT_EXPIRED);
+			glDeleteSync (fences[slot]);
+			fences[slot] = NULL;
+			BatchFrame* frame = new BatchFrame;
+			snprintf (frame->filename, sizeof(frame->filename), job.output_pattern, slot_frames[slot]);
+			frame->pixels = malloc (frame_size);
+			void* data = pixel_buffers[slot]->map (GL_READ_ONLY);
+			if (data)
+				memcpy (frame->pixels, data, frame_size);
+			else
+				memset (frame->pixels, 0, frame_size);
+			pixel_buffers[slot]->unmap ();
+			
+			// back-pressure: with a full queue the renderer waits for the
+			// encoders instead of buffering more frames in memory
+			pthread_mutex_lock (&queue.mutex);
+			if (queue.frames.count() >= max_queued_frames) {
+				encoder_stalls++;
+				while (queue.frames.count() >= max_queued_frames)
+					pthread_cond_wait (&queue.space_available, &queue.mutex);
+			}
+			queue.frames.append (frame);
+			int depth = queue.frames.count ();
+			pthread_cond_signal (&queue.frame_available);
+			pthread_mutex_unlock (&queue.mutex);
+			if (depth > max_queue_depth) max_queue_depth = depth;
+			queue_depth_sum += depth;
+		}
+		if (i >= frame_count)
+			continue;
+		
+		// render the frame and start its readback without waiting for it
+		int frame_number = job.first_frame + i;
+		job.get_camera (frame_number, camera.position, target.position);
+		framebuffer.bind ();
+		camera.take_a_picture ();
+		pixel_buffers[slot]->bind ();
+		glReadPixels (0, 0, job.width, job.height, GL_RGBA, hdr ? GL_FLOAT : GL_UNSIGNED_BYTE, NULL);
+		pixel_buffers[slot]->unbind ();
+		framebuffer.unbind ();
+		fences[slot] = glFenceSync (GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+		slot_frames[slot] = frame_number;
+		frames_rendered++;
+		
+		double now = get_time ();
+		if (now - last_report >= 1.0) {
+			pthread_mutex_lock (&queue.mutex);
+			int depth = queue.frames.count ();
+			int encoded = queue.encoded;
+			pthread_mutex_unlock (&queue.mutex);
+			printf ("BatchRenderer::run: frame %d/%d, %.1f fps, %d encoded, encoder queue %d (max %d)\n", frames_rendered, frame_count, frames_rendered / (now - start), encoded, depth, max_queue_depth);
+			last_report = now;
+		}
+	}
+	
+	// let the encoders finish
+	pthread_mutex_lock (&queue.mutex);
+	queue.done = true;
+	pthread_cond_broadcast (&queue.frame_available);
+	pthread_mutex_unlock (&queue.mutex);
+	for (int i=0; i<thread_count; i++)
+		pthread_join (threads[i], NULL);
+	
+	seconds = get_time () - start;
+	frames_encoded = queue.encoded - queue.failed;
+	fps = seconds > 0.0 ? frames_encoded / seconds : 0.0;
+	average_queue_depth = frames_rendered > 0 ? queue_depth_sum / frames_rendered : 0.0f;
+	printf ("BatchRenderer::run: %d frames in %.2f s, %.1f fps, encoder queue average %.1f, max %d, %d stalls\n", frames_encoded, seconds, fps, average_queue_depth, max_queue_depth, encoder_stalls);
+	if (queue.failed)
+		fprintf (stderr, "BatchRenderer::run: %d frames could not be written\n", queue.failed);
+	
+	delete[] threads;
+	pthread_cond_destroy (&queue.space_available);
+	pthread_cond_destroy (&queue.frame_available);
+	pthread_mutex_destroy (&queue.mutex);
+	for (int i=0; i<slots; i++)
+		delete pixel_buffers[i];
+	delete[] pixel_buffers;
+	delete[] fences;
+	delete[] slot_frames;
+	return queue.failed == 0;
+}
+
+}
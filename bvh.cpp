@@ -0,0 +1,583 @@
+/*
+
+Copyright © 2012-2015 Elias Aebi
+
+All rights reserved.
+
+*/
+
+#include "infra.hpp"
+#include <pthread.h>
+#include <stdio.h>
+#include <float.h>
+#include <time.h>
+#ifdef __SSE__
+#include <xmmintrin.h>
+#endif
+
+namespace infra {
+
+// BVH construction
+struct BuildBox {
+	vec3 min, max;
+	BuildBox (): min(FLT_MAX,FLT_MAX,FLT_MAX), max(-FLT_MAX,-FLT_MAX,-FLT_MAX) {}
+	void add (const vec3& v) {
+		if (v.x < min.x) min.x = v.x;
+		if (v.y < min.y) min.y = v.y;
+		if (v.z < min.z) min.z = v.z;
+		if (v.x > max.x) max.x = v.x;
+		if (v.y > max.y) max.y = v.y;
+		if (v.z > max.z) max.z = v.z;
+	}
+	void add (const BuildBox& box) {
+		add (box.min);
+		add (box.max);
+	}
+	float get_area () const {
+		if (min.x > max.x) return 0.0f;
+		vec3 d = max - min;
+		return 2.0f * (d.x*d.y + d.y*d.z + d.z*d.x);
+	}
+};
+static float get_axis (const vec3& v, int axis) {
+	return axis == 0 ? v.x : axis == 1 ? v.y : v.z;
+}
+struct BinaryNode {
+	BuildBox box;
+	int left, right; // -1 for leaves
+	int first, count;
+};
+
+#define BVH_BINS 16
+#define BVH_MAX_LEAF_SIZE 4
+// deeper than this the build splits in half, which keeps the 4-wide tree
+// within 48+31 levels, and a traversal pushes at most 3 nodes per level
+#define BVH_MAX_DEPTH 48
+#define BVH_STACK_SIZE 256
+
+// binned SAH split of the primitives first to first+count-1
+static int build_binary (List<BinaryNode>& nodes, const BuildBox* boxes, const vec3* centroids, int* indices, int first, int count, int depth) {
+	BinaryNode node;
+	node.left = -1;
+	node.right = -1;
+	node.first = first;
+	node.count = count;
+	BuildBox centroid_box;
+	for (int i=first; i<first+count; i++) {
+		node.box.add (boxes[indices[i]]);
+		centroid_box.add (centroids[indices[i]]);
+	}
+	int index = nodes.count ();
+	nodes.append (node);
+	if (count <= 1)
+		return index;
+	
+	// the cheapest split over all axes, the cost of a leaf is count*area
+	float best_cost = FLT_MAX;
+	int best_axis = -1;
+	int best_bin = 0;
+	for (int axis=0; axis<3 && depth<BVH_MAX_DEPTH; axis++) {
+		float lo = get_axis (centroid_box.min, axis);
+		float extent = get_axis (centroid_box.max, axis) - lo;
+		if (extent <= 0.0f)
+			continue;
+		BuildBox bins[BVH_BINS];
+		int bin_counts[BVH_BINS] = {0};
+		for (int i=first; i<first+count; i++) {
+			int b = (int)((get_axis(centroids[indices[i]], axis) - lo) / extent * BVH_BINS);
+			if (b >= BVH_BINS) b = BVH_BINS-1;
+			bins[b].add (boxes[indices[i]]);
+			bin_counts[b]++;
+		}
+		// sweep from the right, then from the left
+		float right_areas[BVH_BINS];
+		int right_counts[BVH_BINS];
+		BuildBox right;
+		int right_count = 0;
+		for (int b=BVH_BINS-1; b>0; b--) {
+			right.add (bins[b]);
+			right_count += bin_counts[b];
+			right_areas[b] = right.get_area ();
+			right_counts[b] = right_count;
+		}
+		BuildBox left;
+		int left_count = 0;
+		for (int b=0; b<BVH_BINS-1; b++) {
+			left.add (bins[b]);
+			left_count += bin_counts[b];
+			if (left_count == 0 || right_counts[b+1] == 0)
+				continue;
+			float cost = left.get_area() * left_count + right_areas[b+1] * right_counts[b+1];
+			if (cost < best_cost) {
+				best_cost = cost;
+				best_axis = axis;
+				best_bin = b;
+			}
+		}
+	}
+	float leaf_cost = node.box.get_area() * count;
+	if (best_axis < 0 && count <= BVH_MAX_LEAF_SIZE)
+		return index;
+	if (best_axis >= 0 && count <= BVH_MAX_LEAF_SIZE && best_cost >= leaf_cost)
+		return index;
+	
+	int middle;
+	if (best_axis < 0) {
+		// all centroids coincide or the tree got too deep, split in half
+		middle = first + count/2;
+	}
+	else {
+		float lo = get_axis (centroid_box.min, best_axis);
+		float extent = get_axis (centroid_box.max, best_axis) - lo;
+		middle = first;
+		for (int i=first; i<first+count; i++) {
+			int b = (int)((get_axis(centroids[indices[i]], best_axis) - lo) / extent * BVH_BINS);
+			if (b >= BVH_BINS) b = BVH_BINS-1;
+			if (b <= best_bin) {
+				int t = indices[i];
+				indices[i] = indices[middle];
+				indices[middle] = t;
+				middle++;
+			}
+		}
+	}
+	int left = build_binary (nodes, boxes, centroids, indices, first, middle-first, depth+1);
+	int right = build_binary (nodes, boxes, centroids, indices, middle, first+count-middle, depth+1);
+	nodes[index].left = left;
+	nodes[index].right = right;
+	return index;
+}
+static void set_child (BVHNode& node, int i, const BuildBox& box, int child, int count) {
+	node.min_x[i] = box.min.x;
+	node.min_y[i] = box.min.y;
+	node.min_z[i] = box.min.z;
+	node.max_x[i] = box.max.x;
+	node.max_y[i] = box.max.y;
+	node.max_z[i] = box.max.z;
+	node.child[i] = child;
+	node.count[i] = count;
+}
+// turns the binary tree into a 4-wide one by pulling up grandchildren
+static int collapse (const List<BinaryNode>& binary, int index, List<BVHNode>& nodes) {
+	int children[4];
+	int child_count = 0;
+	const BinaryNode& node = binary[index];
+	if (node.left < 0)
+		children[child_count++] = index;
+	else {
+		children[child_count++] = node.left;
+		children[child_count++] = node.right;
+	}
+	while (child_count < 4) {
+		// open the inner child with the largest area
+		int largest = -1;
+		for (int i=0; i<child_count; i++) {
+			const BinaryNode& child = binary[children[i]];
+			if (child.left >= 0 && (largest < 0 || child.box.get_area() > binary[children[largest]].box.get_area()))
+				largest = i;
+		}
+		if (largest < 0)
+			break;
+		const BinaryNode& opened = binary[children[largest]];
+		children[largest] = opened.left;
+		children[child_count++] = opened.right;
+	}
+	
+	int result = nodes.count ();
+	BVHNode empty;
+	for (int i=0; i<4; i++)
+		set_child (empty, i, BuildBox(), 0, -1);
+	nodes.append (empty);
+	for (int i=0; i<child_count; i++) {
+		const BinaryNode& child = binary[children[i]];
+		if (child.left < 0)
+			set_child (nodes[result], i, child.box, child.first, child.count);
+		else {
+			int inner = collapse (binary, children[i], nodes);
+			set_child (nodes[result], i, child.box, inner, 0);
+		}
+	}
+	return result;
+}
+// builds nodes over the boxes, indices receives the primitive order of the leaves
+static void build_bvh (List<BVHNode>& nodes, const BuildBox* boxes, int count, int* indices) {
+	nodes.clear ();
+	List<vec3> centroids;
+	for (int i=0; i<count; i++) {
+		centroids.append (0.5f * (boxes[i].min + boxes[i].max));
+		indices[i] = i;
+	}
+	if (count == 0)
+		return;
+	List<BinaryNode> binary;
+	build_binary (binary, boxes, &centroids[0], indices, 0, count, 0);
+	collapse (binary, 0, nodes);
+}
+
+// BVH traversal
+struct TraversalRay {
+	float origin[3];
+	float inverse_direction[3];
+};
+static TraversalRay get_traversal_ray (const Ray& ray) {
+	TraversalRay r;
+	const float d[] = {ray.direction.x, ray.direction.y, ray.direction.z};
+	const float o[] = {ray.origin.x, ray.origin.y, ray.origin.z};
+	for (int i=0; i<3; i++) {
+		r.origin[i] = o[i];
+		// avoid 0*inf for axis-parallel rays
+		float di = fabs(d[i]) < 1e-20f ? (d[i] < 0.0f ? -1e-20f : 1e-20f) : d[i];
+		r.inverse_direction[i] = 1.0f / di;
+	}
+	return r;
+}
+// returns a bit per child whose box the ray enters before max_distance, and their entry distances
+static int intersect_children (const BVHNode& node, const TraversalRay& ray, float max_distance, float* distances) {
+#ifdef __SSE__
+	__m128 t1, t2, near, far;
+	t1 = _mm_mul_ps (_mm_sub_ps(_mm_loadu_ps(node.min_x), _mm_set1_ps(ray.origin[0])), _mm_set1_ps(ray.inverse_direction[0]));
+	t2 = _mm_mul_ps (_mm_sub_ps(_mm_loadu_ps(node.max_x), _mm_set1_ps(ray.origin[0])), _mm_set1_ps(ray.inverse_direction[0]));
+	near = _mm_min_ps (t1, t2);
+	far = _mm_max_ps (t1, t2);
+	t1 = _mm_mul_ps (_mm_sub_ps(_mm_loadu_ps(node.min_y), _mm_set1_ps(ray.origin[1])), _mm_set1_ps(ray.inverse_direction[1]));
+	t2 = _mm_mul_ps (_mm_sub_ps(_mm_loadu_ps(node.max_y), _mm_set1_ps(ray.origin[1])), _mm_set1_ps(ray.inverse_direction[1]));
+	near = _mm_max_ps (near, _mm_min_ps(t1, t2));
+	far = _mm_min_ps (far, _mm_max_ps(t1, t2));
+	t1 = _mm_mul_ps (_mm_sub_ps(_mm_loadu_ps(node.min_z), _mm_set1_ps(ray.origin[2])), _mm_set1_ps(ray.inverse_direction[2]));
+	t2 = _mm_mul_ps (_mm_sub_ps(_mm_loadu_ps(node.max_z), _mm_set1_ps(ray.origin[2])), _mm_set1_ps(ray.inverse_direction[2]));
+	near = _mm_max_ps (_mm_max_ps(near, _mm_min_ps(t1, t2)), _mm_setzero_ps());
+	far = _mm_min_ps (_mm_min_ps(far, _mm_max_ps(t1, t2)), _mm_set1_ps(max_distance));
+	_mm_storeu_ps (distances, near);
+	return _mm_movemask_ps (_mm_cmple_ps(near, far));
+#else
+	int mask = 0;
+	for (int i=0; i<4; i++) {
+		const float lo[] = {node.min_x[i], node.min_y[i], node.min_z[i]};
+		const float hi[] = {node.max_x[i], node.max_y[i], node.max_z[i]};
+		float near = 0.0f;
+		float far = max_distance;
+		for (int axis=0; axis<3; axis++) {
+			float t1 = (lo[axis] - ray.origin[axis]) * ray.inverse_direction[axis];
+			float t2 = (hi[axis] - ray.origin[axis]) * ray.inverse_direction[axis];
+			if (t1 > t2) { float t = t1; t1 = t2; t2 = t; }
+			if (t1 > near) near = t1;
+			if (t2 < far) far = t2;
+		}
+		distances[i] = near;
+		if (near <= far) mask |= 1 << i;
+	}
+	return mask;
+#endif
+}
+// visits the leaves front to back, intersect_leaf (first, count) returns
+// whether it hit and lowers hit.distance
+template <class F> static bool traverse (const List<BVHNode>& nodes, const Ray& ray, RayHit& hit, bool any_hit, F& intersect_leaf) {
+	if (nodes.count() == 0)
+		return false;
+	TraversalRay r = get_traversal_ray (ray);
+	int stack[BVH_STACK_SIZE];
+	int stack_size = 0;
+	stack[stack_size++] = 0;
+	bool result = false;
+	while (stack_size > 0) {
+		const BVHNode& node = nodes[stack[--stack_size]];
+		float distances[4];
+		int mask = intersect_children (node, r, hit.distance, distances);
+		if (mask == 0)
+			continue;
+		// the hit children sorted by entry distance
+		int order[4];
+		int hit_count = 0;
+		for (int i=0; i<4; i++) {
+			if (!(mask & (1 << i)) || node.count[i] < 0)
+				continue;
+			int j = hit_count++;
+			while (j > 0 && distances[order[j-1]] > distances[i]) {
+				order[j] = order[j-1];
+				j--;
+			}
+			order[j] = i;
+		}
+		// leaves are tested right away, inner nodes are pushed far to near
+		for (int k=0; k<hit_count; k++) {
+			int i = order[k];
+			if (node.count[i] > 0 && distances[i] <= hit.distance && intersect_leaf(node.child[i], node.count[i])) {
+				result = true;
+				if (any_hit) return true;
+			}
+		}
+		for (int k=hit_count-1; k>=0; k--) {
+			int i = order[k];
+			if (node.count[i] == 0)
+				stack[stack_size++] = node.child[i];
+		}
+	}
+	return result;
+}
+
+// MeshGeometry
+MeshGeometry::MeshGeometry (const aiMesh* mesh) {
+	List<BuildBox> boxes;
+	List<int> faces;
+	for (unsigned int i=0; i<mesh->mNumFaces; i++) {
+		const aiFace& face = mesh->mFaces[i];
+		if (face.mNumIndices != 3)
+			continue;
+		BuildBox box;
+		for (int j=0; j<3; j++) {
+			const aiVector3D& v = mesh->mVertices[face.mIndices[j]];
+			box.add (vec3(v.x, v.y, v.z));
+		}
+		boxes.append (box);
+		faces.append (i);
+	}
+	List<int> order;
+	for (int i=0; i<faces.count(); i++)
+		order.append (0);
+	build_bvh (nodes, faces.count() ? &boxes[0] : NULL, faces.count(), faces.count() ? &order[0] : NULL);
+	
+	// store the triangles in leaf order
+	BuildBox bounds;
+	for (int i=0; i<order.count(); i++) {
+		int face = faces[order[i]];
+		const aiFace& f = mesh->mFaces[face];
+		const aiVector3D& v0 = mesh->mVertices[f.mIndices[0]];
+		const aiVector3D& v1 = mesh->mVertices[f.mIndices[1]];
+		const aiVector3D& v2 = mesh->mVertices[f.mIndices[2]];
+		const float data[] = {v0.x, v0.y, v0.z, v1.x-v0.x, v1.y-v0.y, v1.z-v0.z, v2.x-v0.x, v2.y-v0.y, v2.z-v0.z};
+		for (int j=0; j<9; j++)
+			triangles.append (data[j]);
+		triangle_indices.append (face);
+		bounds.add (boxes[order[i]]);
+	}
+	min = bounds.min;
+	max = bounds.max;
+}
+int MeshGeometry::get_triangle_count () {
+	return triangle_indices.count ();
+}
+struct TriangleLeaf {
+	const float* triangles;
+	const int* triangle_indices;
+	const Ray* ray;
+	RayHit* hit;
+	bool any_hit;
+	bool operator () (int first, int count) {
+		// Möller-Trumbore
+		bool result = false;
+		const vec3& d = ray->direction;
+		for (int i=first; i<first+count; i++) {
+			const float* t = triangles + i*9;
+			vec3 e1 (t[3], t[4], t[5]);
+			vec3 e2 (t[6], t[7], t[8]);
+			vec3 p = cross (d, e2);
+			float determinant = dot (e1, p);
+			if (fabs(determinant) < 1e-12f)
+				continue;
+			float inverse = 1.0f / determinant;
+			vec3 s = ray->origin - vec3 (t[0], t[1], t[2]);
+			float u = dot (s, p) * inverse;
+			if (u < 0.0f || u > 1.0f)
+				continue;
+			vec3 q = cross (s, e1);
+			float v = dot (d, q) * inverse;
+			if (v < 0.0f || u + v > 1.0f)
+				continue;
+			float distance = dot (e2, q) * inverse;
+			if (distance <= 0.0f || distance >= hit->distance)
+				continue;
+			hit->distance = distance;
+			hit->triangle = triangle_indices[i];
+			hit->u = u;
+			hit->v = v;
+			result = true;
+			if (any_hit) break;
+		}
+		return result;
+	}
+};
+bool MeshGeometry::intersect (const Ray& ray, RayHit& hit, bool any_hit) {
+	if (triangle_indices.count() == 0)
+		return false;
+	TriangleLeaf leaf = {&triangles[0], &triangle_indices[0], &ray, &hit, any_hit};
+	return traverse (nodes, ray, hit, any_hit, leaf);
+}
+
+// SceneBVH
+SceneBVH::SceneBVH (Scene* scene): scene(scene), min(0.0f,0.0f,0.0f), max(0.0f,0.0f,0.0f) {
+	
+}
+// the inverse of a rotation and translation
+static mat4 get_rigid_inverse (const mat4& m) {
+	mat4 r = mat4::identity ();
+	for (int column=0; column<3; column++)
+		for (int row=0; row<3; row++)
+			r.m[column*4+row] = m.m[row*4+column];
+	vec3 t (m.m[12], m.m[13], m.m[14]);
+	r.m[12] = -(r.m[0]*t.x + r.m[4]*t.y + r.m[8]*t.z);
+	r.m[13] = -(r.m[1]*t.x + r.m[5]*t.y + r.m[9]*t.z);
+	r.m[14] = -(r.m[2]*t.x + r.m[6]*t.y + r.m[10]*t.z);
+	return r;
+}
+void SceneBVH::build () {
+	scene->update_transforms ();
+	// the world space boxes of the instances that have geometry
+	List<Instance*> candidates;
+	List<mat4> transforms;
+	List<BuildBox> boxes;
+	BuildBox bounds;
+	for (int i=0; i<scene->instances.count(); i++) {
+		Instance* instance = scene->instances[i];
+		Object* object = instance->get_object ();
+		if (!object)
+			continue;
+		BuildBox local;
+		for (int j=0; j<object->meshes.count(); j++) {
+			MeshGeometry* geometry = object->meshes[j]->geometry;
+			if (geometry && geometry->get_triangle_count() > 0) {
+				local.add (geometry->min);
+				local.add (geometry->max);
+			}
+		}
+		if (local.min.x > local.max.x)
+			continue;
+		mat4 transform = instance->get_transform ();
+		BuildBox box;
+		for (int corner=0; corner<8; corner++) {
+			vec3 v (corner & 1 ? local.max.x : local.min.x, corner & 2 ? local.max.y : local.min.y, corner & 4 ? local.max.z : local.min.z);
+			box.add (transform * v);
+		}
+		candidates.append (instance);
+		transforms.append (transform);
+		boxes.append (box);
+		bounds.add (box);
+	}
+	List<int> order;
+	for (int i=0; i<candidates.count(); i++)
+		order.append (0);
+	build_bvh (nodes, candidates.count() ? &boxes[0] : NULL, candidates.count(), candidates.count() ? &order[0] : NULL);
+	instances.clear ();
+	inverse_transforms.clear ();
+	for (int i=0; i<order.count(); i++) {
+		instances.append (candidates[order[i]]);
+		inverse_transforms.append (get_rigid_inverse(transforms[order[i]]));
+	}
+	min = bounds.min;
+	max = bounds.max;
+}
+bool SceneBVH::intersect_instance (int index, const Ray& ray, RayHit& hit, bool any_hit) {
+	// the transforms are rigid, so distances are the same in object space
+	const mat4& m = inverse_transforms[index];
+	Ray local;
+	local.origin = m * ray.origin;
+	const vec3& d = ray.direction;
+	local.direction = vec3 (m.m[0]*d.x + m.m[4]*d.y + m.m[8]*d.z, m.m[1]*d.x + m.m[5]*d.y + m.m[9]*d.z, m.m[2]*d.x + m.m[6]*d.y + m.m[10]*d.z);
+	local.max_distance = hit.distance;
+	Object* object = instances[index]->get_object ();
+	bool result = false;
+	for (int i=0; i<object->meshes.count(); i++) {
+		Mesh* mesh = object->meshes[i];
+		if (!mesh->geometry || !mesh->geometry->intersect(local, hit, any_hit))
+			continue;
+		hit.instance = instances[index];
+		hit.mesh = mesh;
+		result = true;
+		if (any_hit) break;
+	}
+	return result;
+}
+struct InstanceLeaf {
+	SceneBVH* bvh;
+	const Ray* ray;
+	RayHit* hit;
+	bool any_hit;
+	bool (SceneBVH::*intersect_instance) (int, const Ray&, RayHit&, bool);
+	bool operator () (int first, int count) {
+		bool result = false;
+		for (int i=first; i<first+count; i++) {
+			if ((bvh->*intersect_instance)(i, *ray, *hit, any_hit)) {
+				result = true;
+				if (any_hit) break;
+			}
+		}
+		return result;
+	}
+};
+bool SceneBVH::intersect (const Ray& ray, RayHit& hit, bool any_hit) {
+	hit.distance = ray.max_distance;
+	hit.instance = NULL;
+	hit.mesh = NULL;
+	hit.triangle = -1;
+	InstanceLeaf leaf = {this, &ray, &hit, any_hit, &SceneBVH::intersect_instance};
+	return traverse (nodes, ray, hit, any_hit, leaf);
+}
+
+struct RayBatch {
+	SceneBVH* bvh;
+	const Ray* rays;
+	RayHit* hits;
+	int count;
+	bool any_hit;
+	int next; // the next chunk to take
+};
+#define RAY_BATCH_CHUNK 256
+static void* ray_worker (void* argument) {
+	RayBatch* batch = (RayBatch*) argument;
+	while (true) {
+		int first = __sync_fetch_and_add (&batch->next, RAY_BATCH_CHUNK);
+		if (first >= batch->count)
+			return NULL;
+		int last = first + RAY_BATCH_CHUNK < batch->count ? first + RAY_BATCH_CHUNK : batch->count;
+		for (int i=first; i<last; i++)
+			batch->bvh->intersect (batch->rays[i], batch->hits[i], batch->any_hit);
+	}
+}
+void SceneBVH::intersect (const Ray* rays, RayHit* hits, int count, bool any_hit, int thread_count) {
+	RayBatch batch = {this, rays, hits, count, any_hit, 0};
+	if (thread_count <= 1) {
+		ray_worker (&batch);
+		return;
+	}
+	// the calling thread works as well
+	pthread_t* threads = new pthread_t[thread_count-1];
+	for (int i=0; i<thread_count-1; i++)
+		pthread_create (&threads[i], NULL, ray_worker, &batch);
+	ray_worker (&batch);
+	for (int i=0; i<thread_count-1; i++)
+		pthread_join (threads[i], NULL);
+	delete[] threads;
+}
+double SceneBVH::benchmark (int ray_count, bool any_hit, int thread_count) {
+	// rays from random points around the scene towards random points in it
+	Ray* rays = new Ray[ray_count];
+	RayHit* hits = new RayHit[ray_count];
+	vec3 center = 0.5f * (min + max);
+	vec3 extent = max - min;
+	unsigned int seed = 1;
+	for (int i=0; i<ray_count; i++) {
+		float r[6];
+		for (int j=0; j<6; j++) {
+			seed = seed * 1664525u + 1013904223u;
+			r[j] = (seed >> 8) * (1.0f / 16777216.0f) - 0.5f;
+		}
+		vec3 origin = center + vec3 (r[0]*extent.x*2.0f, r[1]*extent.y*2.0f, r[2]*extent.z*2.0f);
+		vec3 target = center + vec3 (r[3]*extent.x, r[4]*extent.y, r[5]*extent.z);
+		vec3 direction = target - origin;
+		rays[i] = Ray (origin, length(direction) > 0.0f ? normalize(direction) : vec3(0.0f,0.0f,1.0f));
+	}
+	timespec start, end;
+	clock_gettime (CLOCK_MONOTONIC, &start);
+	intersect (rays, hits, ray_count, any_hit, thread_count);
+	clock_gettime (CLOCK_MONOTONIC, &end);
+	double seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) * 1e-9;
+	int hit_count = 0;
+	for (int i=0; i<ray_count; i++)
+		if (hits[i].instance) hit_count++;
+	delete[] rays;
+	delete[] hits;
+	double rays_per_second = seconds > 0.0 ? ray_count / seconds : 0.0;
+	printf ("SceneBVH::benchmark: %s, %d threads, %d instances: %.2f Mrays/s (%d of %d rays hit)\n", any_hit ? "any hit" : "closest hit", thread_count, instances.count(), rays_per_second * 1e-6, hit_count, ray_count);
+	return rays_per_second;
+}
+
+}
@@ -11,6 +11,8 @@ All rights reserved.
 #include <assimp/scene.h>
 #include <assimp/postprocess.h>
 #include <stdio.h>
+#include <string.h>
+#include <new>
 
 namespace infra {
 
@@ -22,14 +24,15 @@ static void print_properties (aiMaterial* material) {
 		printf ("%d: %s\n", i, key.C_Str());
 	}
 }
-Material::Material (aiMaterial* material): colormap(NULL), normalmap(NULL) {
+const char* Material::feature_names[] = {"COLORMAP", "NORMALMAP", "SPECULAR", "FOG", "INSTANCING", "MULTIVIEW"};
+Material::Material (aiMaterial* material, DecodedImages* images): colormap(NULL), normalmap(NULL), features(FOG), program(NULL), cached_features(0), cached_generation(-1) {
 //	printf ("Material::Material: material properties:\n");
 //	print_properties (material);
 	if (material->GetTextureCount(aiTextureType_DIFFUSE)) {
 		aiString texture_path;
 		material->GetTexture (aiTextureType_DIFFUSE, 0, &texture_path);
 		printf ("Material::Material(): found diffuse texture: %s\n", texture_path.C_Str());
-		colormap = new Texture (texture_path.C_Str());
+		colormap = new Texture (texture_path.C_Str(), true, images);
 	}
 	else {
 		aiColor3D diffuse_color;
@@ -49,23 +52,43 @@ Material::Material (aiMaterial* material): colormap(NULL), normalmap(NULL) {
 		aiString texture_path;
 		material->GetTexture (aiTextureType_NORMALS, 0, &texture_path);
 		printf ("Material::Material(): found normals texture: %s\n", texture_path.C_Str());
-		normalmap = new Texture (texture_path.C_Str());
+		normalmap = new Texture (texture_path.C_Str(), true, images);
 	}
-	// create the program
-	Shader* vs = new Shader ("shaders/vertex_shader.glsl", GL_VERTEX_SHADER);
-	Shader* fs;
-	if (colormap || normalmap)
-		fs = new Shader ("shaders/material_texture.glsl", GL_FRAGMENT_SHADER);
-	else
-		fs = new Shader ("shaders/material.glsl", GL_FRAGMENT_SHADER);
-	program = new Program (vs, fs);
+	// specular highlights unless the specular color is black
+	aiColor3D specular_color (1.0f, 1.0f, 1.0f);
+	if (material->Get (AI_MATKEY_COLOR_SPECULAR, specular_color) != AI_SUCCESS || specular_color.r > 0.0f || specular_color.g > 0.0f || specular_color.b > 0.0f)
+		features |= SPECULAR;
+	// the program is compiled on first use or by Scene::precompile
+	if (colormap)
+		features |= COLORMAP;
+	if (normalmap)
+		features |= NORMALMAP;
 }
 Material::~Material () {
 	delete colormap;
 	delete normalmap;
-	delete program;
 }
-void Material::activate () {
+Program* Material::get_program (int extra_features) {
+	// resolved variants skip the ProgramCache lookup, which compares strings
+	int variant = (extra_features & (INSTANCING|MULTIVIEW)) / INSTANCING;
+	bool cacheable = (extra_features & ~(INSTANCING|MULTIVIEW)) == 0;
+	if (cached_features != features || cached_generation != ProgramCache::generation) {
+		for (int i=0; i<4; i++)
+			programs[i] = NULL;
+		cached_features = features;
+		cached_generation = ProgramCache::generation;
+	}
+	if (cacheable && programs[variant])
+		return programs[variant];
+	int all_features = features | extra_features;
+	const char* vertex_shader = all_features & MULTIVIEW ? "shaders/multiview_vertex_shader.glsl" : "shaders/vertex_shader.glsl";
+	Program* result = ProgramCache::get (vertex_shader, "shaders/material.glsl", all_features, feature_names);
+	if (cacheable)
+		programs[variant] = result;
+	return result;
+}
+void Material::activate (int extra_features) {
+	program = get_program (extra_features);
 	program->use ();
 	if (colormap) {
 		colormap->bind (0);
@@ -78,6 +101,12 @@ void Material::activate () {
 		program->set_uniform_int ("normalmap", 1);
 	}
 }
+void Material::request (float screen_size) {
+	if (colormap)
+		colormap->request (screen_size);
+	if (normalmap)
+		normalmap->request (screen_size);
+}
 void Material::deactivate () {
 	if (normalmap) {
 		normalmap->unbind ();
@@ -88,7 +117,8 @@ void Material::deactivate () {
 }
 
 // Mesh
-Mesh::Mesh (aiMesh* mesh, const aiScene* scene): vertex_count(mesh->mNumVertices), buffer(vertex_count*4*sizeof(aiVector3D)), material(scene->mMaterials[mesh->mMaterialIndex]) {
+Program* Mesh::depth_program = NULL;
+Mesh::Mesh (aiMesh* mesh, const aiScene* scene, bool keep_geometry, DecodedImages* images): vertex_count(mesh->mNumVertices), buffer(vertex_count*4*sizeof(aiVector3D), "Mesh"), material(scene->mMaterials[mesh->mMaterialIndex], images), geometry(NULL), vertex_array(NULL) {
 	if (mesh->mPrimitiveTypes & ~aiPrimitiveType_TRIANGLE) {
 		printf ("Mesh::Mesh: the mesh contains faces that are not triangles\n");
 	}
@@ -97,9 +127,110 @@ Mesh::Mesh (aiMesh* mesh, const aiScene* scene): vertex_count(mesh->mNumVertices
 	buffer.set_data (vertex_count*sizeof(aiVector3D), vertex_count*sizeof(aiVector3D), mesh->mNormals);
 	buffer.set_data (vertex_count*2*sizeof(aiVector3D), vertex_count*sizeof(aiVector3D), mesh->mTextureCoords[0]);
 	buffer.set_data (vertex_count*3*sizeof(aiVector3D), vertex_count*sizeof(aiVector3D), mesh->mTangents);
+	if (Backend::type == Backend::CORE) {
+		vertex_array = new VertexArray ("Mesh");
+		vertex_array->set_attribute (Backend::VERTEX, &buffer, 0, sizeof(aiVector3D), 3);
+		vertex_array->set_attribute (Backend::NORMAL, &buffer, vertex_count*sizeof(aiVector3D), sizeof(aiVector3D), 3);
+		vertex_array->set_attribute (Backend::TEX_COORD, &buffer, vertex_count*2*sizeof(aiVector3D), sizeof(aiVector3D), 3);
+		vertex_array->set_attribute (Backend::TANGENT, &buffer, vertex_count*3*sizeof(aiVector3D), sizeof(aiVector3D), 3);
+	}
+	
+	// bounding sphere
+	vec3 min (0.0f, 0.0f, 0.0f);
+	vec3 max (0.0f, 0.0f, 0.0f);
+	for (unsigned int i=0; i<vertex_count; i++) {
+		vec3 v (mesh->mVertices[i].x, mesh->mVertices[i].y, mesh->mVertices[i].z);
+		if (i == 0 || v.x < min.x) min.x = v.x;
+		if (i == 0 || v.y < min.y) min.y = v.y;
+		if (i == 0 || v.z < min.z) min.z = v.z;
+		if (i == 0 || v.x > max.x) max.x = v.x;
+		if (i == 0 || v.y > max.y) max.y = v.y;
+		if (i == 0 || v.z > max.z) max.z = v.z;
+	}
+	center = 0.5f * (min + max);
+	radius = 0.5f * length (max - min);
+	
+	if (keep_geometry)
+		geometry = new MeshGeometry (mesh);
+}
+Mesh::~Mesh () {
+	delete geometry;
+	delete vertex_array;
 }
 void Mesh::draw () {
+	// estimate the size on screen to request the texture levels
+	const GLfloat* m = FixedFunction::get_matrix(FixedFunction::MODELVIEW).m;
+	float distance = -(m[2]*center.x + m[6]*center.y + m[10]*center.z + m[14]);
+	if (distance > radius)
+		material.request (2.0f * radius / distance * TextureStreamer::screen_scale);
+	else
+		material.request (TextureStreamer::screen_scale);
+	
 	material.activate ();
+	int tangent_index = enable_arrays ();
+	
+	// do the actual drawing
+	draw_arrays (GL_TRIANGLES, 0, vertex_count);
+	
+	disable_arrays (tangent_index);
+	material.deactivate ();
+}
+void Mesh::draw_instanced (Buffer* transforms, int count) {
+	material.request (TextureStreamer::screen_scale);
+	material.activate (Material::INSTANCING);
+	int tangent_index = enable_arrays ();
+	
+	// one model matrix (4 columns) per instance
+	int instance_index[4];
+	if (vertex_array) {
+		for (int i=0; i<4; i++) {
+			instance_index[i] = Backend::INSTANCE + i;
+			vertex_array->set_attribute (instance_index[i], transforms, i*4*sizeof(GLfloat), 16*sizeof(GLfloat), 4, GL_FLOAT, 1);
+		}
+	}
+	else {
+		transforms->bind ();
+		for (int i=0; i<4; i++) {
+			const char* names[] = {"in_instance_0", "in_instance_1", "in_instance_2", "in_instance_3"};
+			instance_index[i] = material.program->get_attribute_location (names[i]);
+			glEnableVertexAttribArray (instance_index[i]);
+			glVertexAttribPointer (instance_index[i], 4, GL_FLOAT, GL_FALSE, 16*sizeof(GLfloat), (void*)(i*4*sizeof(GLfloat)));
+			glVertexAttribDivisor (instance_index[i], 1);
+		}
+		transforms->unbind ();
+	}
+	
+	draw_arrays (GL_TRIANGLES, 0, vertex_count, count);
+	
+	for (int i=0; i<4; i++) {
+		if (vertex_array)
+			vertex_array->disable_attribute (instance_index[i]);
+		else {
+			glVertexAttribDivisor (instance_index[i], 0);
+			glDisableVertexAttribArray (instance_index[i]);
+		}
+	}
+	disable_arrays (tangent_index);
+	material.deactivate ();
+}
+void Mesh::draw_views (ViewSet* views, unsigned int mask) {
+	material.request (TextureStreamer::screen_scale);
+	material.activate (Material::MULTIVIEW);
+	views->use (material.program);
+	material.program->set_uniform_int ("view_mask", mask);
+	int tangent_index = enable_arrays ();
+	
+	// one GL instance per view, the vertex shader selects the layer
+	draw_arrays (GL_TRIANGLES, 0, vertex_count, views->count);
+	
+	disable_arrays (tangent_index);
+	material.deactivate ();
+}
+int Mesh::enable_arrays () {
+	if (vertex_array) {
+		vertex_array->bind ();
+		return Backend::TANGENT;
+	}
 	buffer.bind ();
 	
 	// get the indices
@@ -117,10 +248,13 @@ void Mesh::draw () {
 	glNormalPointer (GL_FLOAT, 0, (void*)(vertex_count*sizeof(aiVector3D)));
 	glTexCoordPointer (3, GL_FLOAT, 0, (void*)(vertex_count*2*sizeof(aiVector3D)));
 	glVertexAttribPointer (tangent_index, 3, GL_FLOAT, GL_FALSE, 0, (void*)(vertex_count*3*sizeof(aiVector3D)));
-	
-	// do the actual drawing
-	glDrawArrays (GL_TRIANGLES, 0, vertex_count);
-	
+	return tangent_index;
+}
+void Mesh::disable_arrays (int tangent_index) {
+	if (vertex_array) {
+		vertex_array->unbind ();
+		return;
+	}
 	// disable vertex arrays
 	glDisableClientState (GL_VERTEX_ARRAY);
 	glDisableClientState (GL_NORMAL_ARRAY);
@@ -128,11 +262,35 @@ void Mesh::draw () {
 	glDisableVertexAttribArray (tangent_index);
 	
 	buffer.unbind ();
-	material.deactivate ();
+}
+void Mesh::draw_depth () {
+	if (!depth_program) {
+		depth_program = new Program ("shaders/position_only.glsl", "shaders/depth_only.glsl");
+		depth_program->set_persistent ();
+	}
+	depth_program->use ();
+	if (vertex_array) {
+		vertex_array->bind ();
+		draw_arrays (GL_TRIANGLES, 0, vertex_count);
+		vertex_array->unbind ();
+		return;
+	}
+	buffer.bind ();
+	
+	// the positions are stored first in the buffer, so they can be used as a position-only stream
+	glEnableClientState (GL_VERTEX_ARRAY);
+	glVertexPointer (3, GL_FLOAT, 0, NULL);
+	draw_arrays (GL_TRIANGLES, 0, vertex_count);
+	glDisableClientState (GL_VERTEX_ARRAY);
+	
+	buffer.unbind ();
 }
 
 // Object
-Object::Object (const char* obj_file) {
+Object::Object (): mesh_arena(NULL), center(0.0f,0.0f,0.0f), radius(0.0f) {
+	
+}
+Object::Object (const char* obj_file, bool keep_geometry): mesh_arena(NULL), center(0.0f,0.0f,0.0f), radius(0.0f) {
 	// load the file
 	Assimp::Importer importer;
 	const aiScene* scene = importer.ReadFile (obj_file, aiProcess_CalcTangentSpace|aiProcess_Triangulate);
@@ -143,37 +301,417 @@ Object::Object (const char* obj_file) {
 	
 	// create the meshes
 	printf ("Object::Object: the file %s contains %d meshes\n", obj_file, scene->mNumMeshes);
+	create (scene, keep_geometry, NULL);
+}
+Object::Object (const aiScene* scene, bool keep_geometry, DecodedImages* images): mesh_arena(NULL), center(0.0f,0.0f,0.0f), radius(0.0f) {
+	create (scene, keep_geometry, images);
+}
+void Object::create (const aiScene* scene, bool keep_geometry, DecodedImages* images) {
+	mesh_arena = (Mesh*) operator new (scene->mNumMeshes * sizeof(Mesh));
 	for (int i=0; i<scene->mNumMeshes; i++) {
-		meshes.append (new Mesh(scene->mMeshes[i], scene));
+		meshes.append (new (&mesh_arena[i]) Mesh(scene->mMeshes[i], scene, keep_geometry, images));
+	}
+	
+	// a bounding sphere around the spheres of the meshes
+	center = vec3 (0.0f, 0.0f, 0.0f);
+	radius = 0.0f;
+	for (int i=0; i<meshes.count(); i++)
+		center += meshes[i]->center;
+	if (meshes.count() > 0)
+		center = center * (1.0f / meshes.count());
+	for (int i=0; i<meshes.count(); i++) {
+		float r = length (meshes[i]->center - center) + meshes[i]->radius;
+		if (r > radius) radius = r;
 	}
 }
 
+Object::~Object () {
+	for (int i=0; i<meshes.count(); i++)
+		meshes[i]->~Mesh ();
+	operator delete (mesh_arena);
+}
+
+void Object::precompile () {
+	for (int i=0; i<meshes.count(); i++)
+		meshes[i]->material.get_program ();
+}
 void Object::draw () {
 	for (int i=0; i<meshes.count(); i++)
 		meshes[i]->draw ();
 }
+void Object::draw_views (ViewSet* views, unsigned int mask) {
+	for (int i=0; i<meshes.count(); i++)
+		meshes[i]->draw_views (views, mask);
+}
+void Object::draw_depth () {
+	for (int i=0; i<meshes.count(); i++)
+		meshes[i]->draw_depth ();
+}
 
 // Instance
-Instance::Instance (Object* object): object(object), position(0.0f,0.0f,0.0f), rotation(0.0f,0.0f,0.0f) {
+Instance::Instance (Object* object): object(object), parent(NULL), scene(NULL), node(-1), position(0.0f,0.0f,0.0f), rotation(0.0f,0.0f,0.0f) {
 	
 }
-Instance::Instance (Object* object, vec3 position): object(object), position(position), rotation(0.0f,0.0f,0.0f) {
+Instance::Instance (Object* object, vec3 position): object(object), parent(NULL), scene(NULL), node(-1), position(position), rotation(0.0f,0.0f,0.0f) {
 	
+}
+Instance::~Instance () {
+	if (scene)
+		scene->remove (this);
+}
+Object* Instance::get_object () {
+	return object;
+}
+Instance* Instance::get_parent () {
+	return parent;
+}
+void Instance::apply_transform () {
+	FixedFunction::multiply (get_transform());
+}
+mat4 Instance::get_local_transform () {
+	// translation, then rotation around z, y and x
+	return mat4::translation(position) * mat4::rotation(rotation.z, vec3(0,0,1)) * mat4::rotation(rotation.y, vec3(0,1,0)) * mat4::rotation(rotation.x, vec3(1,0,0));
+}
+mat4 Instance::get_transform () {
+	if (scene && node >= 0)
+		return scene->world_matrices[node];
+	return get_local_transform ();
+}
+vec3 Instance::get_world_position () {
+	mat4 m = get_transform ();
+	return vec3 (m.m[12], m.m[13], m.m[14]);
 }
 void Instance::draw () {
-	glPushMatrix ();
-	glTranslatef (position.x, position.y, position.z);
-	glRotatef (rotation.z, 0, 0, 1);
-	glRotatef (rotation.y, 0, 1, 0);
-	glRotatef (rotation.x, 1, 0, 0);
+	FixedFunction::push_matrix ();
+	apply_transform ();
 	object->draw ();
-	glPopMatrix ();
+	FixedFunction::pop_matrix ();
+}
+void Instance::draw_views (ViewSet* views, unsigned int mask) {
+	// the modelview matrix contains only the model, the views are applied in the shader
+	FixedFunction::push_matrix ();
+	FixedFunction::load_identity ();
+	apply_transform ();
+	object->draw_views (views, mask);
+	FixedFunction::pop_matrix ();
+}
+void Instance::draw_depth () {
+	FixedFunction::push_matrix ();
+	apply_transform ();
+	object->draw_depth ();
+	FixedFunction::pop_matrix ();
+}
+
+// Light
+Program* Light::program = NULL;
+Light::Light (float x, float y, float z): size(10.0f), color(1.0f, 1.0f, 1.0f), position(x, y, z) {
+	
+}
+void Light::draw (Texture* color, Texture* normal, Texture* positionmap, const GLfloat* m) {
+	if (!program) {
+		program = new Program ("shaders/vertex_shader.glsl", "shaders/light.glsl");
+		program->set_persistent ();
+	}
+	// the G-buffer positions are in eye space
+	vec3 p (
+		m[0]*position.x + m[4]*position.y + m[8]*position.z + m[12],
+		m[1]*position.x + m[5]*position.y + m[9]*position.z + m[13],
+		m[2]*position.x + m[6]*position.y + m[10]*position.z + m[14]
+	);
+	program->use ();
+	program->set_uniform_vec3 ("light_position", p);
+	program->set_uniform_vec3 ("light_color", vec3(this->color.r, this->color.g, this->color.b));
+	program->set_uniform_float ("light_size", size);
+	draw_3_textures (color, normal, positionmap, program);
 }
 
 // Scene
-void Scene::draw () {
+struct FrontToBack {
+	vec3 eye;
+	FrontToBack (const vec3& eye): eye(eye) {}
+	bool operator () (Instance* i1, Instance* i2) const {
+		vec3 d1 = i1->get_world_position() - eye;
+		vec3 d2 = i2->get_world_position() - eye;
+		return d1.x*d1.x + d1.y*d1.y + d1.z*d1.z < d2.x*d2.x + d2.y*d2.y + d2.z*d2.z;
+	}
+};
+Scene::Scene (): update(0), dirty(false) {
+	
+}
+Scene::~Scene () {
+	for (int i=0; i<nodes.count(); i++) {
+		if (nodes[i] && nodes[i]->scene == this) {
+			nodes[i]->scene = NULL;
+			nodes[i]->node = -1;
+		}
+	}
+	for (int i=0; i<instances.count(); i++) {
+		if (instances[i]->scene == this) {
+			instances[i]->scene = NULL;
+			instances[i]->node = -1;
+		}
+	}
+}
+void Scene::add (Instance* instance) {
+	if (instance->scene && instance->scene != this)
+		instance->scene->remove (instance);
+	instances.append (instance);
+	instance->scene = this;
+	instance->node = -1;
+	dirty = true;
+}
+void Scene::remove (Instance* instance) {
+	for (int i=0; i<instances.count(); i++) {
+		if (instances[i] == instance) {
+			instances.remove (i);
+			break;
+		}
+	}
+	for (int i=0; i<instances.count(); i++) {
+		if (instances[i]->parent == instance)
+			instances[i]->parent = NULL;
+	}
+	// the old hierarchy must not touch the instance again, it may be deleted
+	if (instance->scene == this && instance->node >= 0 && instance->node < nodes.count() && nodes[instance->node] == instance)
+		nodes[instance->node] = NULL;
+	if (instance->scene == this) {
+		instance->scene = NULL;
+		instance->node = -1;
+	}
+	draw_order.clear ();
+	dirty = true;
+}
+bool Scene::set_parent (Instance* child, Instance* parent) {
+	for (Instance* i=parent; i; i=i->parent) {
+		if (i == child) {
+			fprintf (stderr, "Scene::set_parent: the parent is a descendant of the child\n");
+			return false;
+		}
+	}
+	child->parent = parent;
+	dirty = true;
+	return true;
+}
+bool Scene::hierarchy_changed () {
+	if (built_instances.count() != instances.count())
+		return true;
+	for (int i=0; i<instances.count(); i++) {
+		if (built_instances[i] != instances[i] || built_parents[i] != instances[i]->parent)
+			return true;
+	}
+	return false;
+}
+void Scene::build_hierarchy () {
+	// the instances changed, the draw order may refer to removed ones
+	draw_order.clear ();
+	// removed instances are already detached and their nodes cleared
+	for (int i=0; i<nodes.count(); i++) {
+		if (nodes[i]) {
+			nodes[i]->scene = NULL;
+			nodes[i]->node = -1;
+		}
+	}
+	built_instances.clear ();
+	built_parents.clear ();
+	int count = instances.count ();
+	for (int i=0; i<count; i++) {
+		instances[i]->node = i;
+		built_instances.append (instances[i]);
+		built_parents.append (instances[i]->parent);
+	}
+	
+	// the children of every instance as ranges of one array
+	List<int> parent_of;
+	List<int> first_child;
+	List<int> children;
+	for (int i=0; i<=count; i++)
+		first_child.append (0);
+	for (int i=0; i<count; i++) {
+		Instance* parent = instances[i]->parent;
+		int p = -1;
+		if (parent && parent->node >= 0 && parent->node < count && instances[parent->node] == parent)
+			p = parent->node;
+		else if (parent)
+			fprintf (stderr, "Scene::build_hierarchy: the parent of an instance is not in the scene\n");
+		parent_of.append (p);
+		if (p >= 0)
+			first_child[p+1]++;
+		children.append (0);
+	}
+	for (int i=0; i<count; i++)
+		first_child[i+1] += first_child[i];
+	List<int> filled;
+	for (int i=0; i<count; i++)
+		filled.append (first_child[i]);
+	for (int i=0; i<count; i++) {
+		if (parent_of[i] >= 0)
+			children[filled[parent_of[i]]++] = i;
+	}
+	
+	// breadth-first from the roots
+	List<int> order;
+	List<int> order_parents;
+	levels.clear ();
+	for (int i=0; i<count; i++) {
+		if (parent_of[i] < 0) {
+			order.append (i);
+			order_parents.append (-1);
+		}
+	}
+	int level_start = 0;
+	while (level_start < order.count()) {
+		levels.append (level_start);
+		int level_end = order.count ();
+		for (int n=level_start; n<level_end; n++) {
+			int i = order[n];
+			for (int c=first_child[i]; c<first_child[i+1]; c++) {
+				order.append (children[c]);
+				order_parents.append (n);
+			}
+		}
+		level_start = level_end;
+	}
+	levels.append (order.count());
+	
+	nodes.clear ();
+	parents.clear ();
+	positions.clear ();
+	rotations.clear ();
+	local_matrices.clear ();
+	world_matrices.clear ();
+	changed.clear ();
+	update++;
+	for (int n=0; n<order.count(); n++) {
+		Instance* instance = instances[order[n]];
+		instance->scene = this;
+		instance->node = n;
+		nodes.append (instance);
+		parents.append (order_parents[n]);
+		positions.append (instance->position);
+		rotations.append (instance->rotation);
+		local_matrices.append (instance->get_local_transform());
+		world_matrices.append (mat4::identity());
+		changed.append (update);
+	}
+}
+int Scene::update_transforms () {
+	update++;
+	if (dirty || hierarchy_changed())
+		build_hierarchy ();
+	dirty = false;
+	
+	// the local matrices of the moved nodes
+	int count = nodes.count ();
+	for (int n=0; n<count; n++) {
+		Instance* instance = nodes[n];
+		if (instance->position != positions[n] || instance->rotation != rotations[n]) {
+			positions[n] = instance->position;
+			rotations[n] = instance->rotation;
+			local_matrices[n] = instance->get_local_transform ();
+			changed[n] = update;
+		}
+	}
+	
+	// level by level, the parents are final before their children; the nodes
+	// of one level are independent of each other
+	int updated = 0;
+	for (int l=0; l+1<levels.count(); l++) {
+		for (int n=levels[l]; n<levels[l+1]; n++) {
+			int p = parents[n];
+			if (p >= 0 && changed[p] == update)
+				changed[n] = update;
+			if (changed[n] != update)
+				continue;
+			world_matrices[n] = p >= 0 ? world_matrices[p] * local_matrices[n] : local_matrices[n];
+			updated++;
+		}
+	}
+	return updated;
+}
+void Scene::sort (const vec3& eye) {
+	update_transforms ();
+	draw_order.clear ();
 	for (int i=0; i<instances.count(); i++)
-		instances[i]->draw ();
+		draw_order.append (instances[i]);
+	draw_order.sort (FrontToBack(eye));
+}
+void Scene::precompile () {
+	for (int i=0; i<instances.count(); i++) {
+		if (instances[i]->get_object())
+			instances[i]->get_object()->precompile ();
+	}
+	for (int i=0; i<store.count(); i++)
+		store.objects[i]->precompile ();
+	printf ("Scene::precompile: %d program variants\n", ProgramCache::get_count());
+}
+void Scene::draw () {
+	update_transforms ();
+	if (draw_order.count() != instances.count())
+		sort (vec3(0.0f,0.0f,0.0f));
+	for (int i=0; i<draw_order.count(); i++)
+		draw_order[i]->draw ();
+	store.draw ();
+}
+void Scene::draw_depth () {
+	update_transforms ();
+	if (draw_order.count() != instances.count())
+		sort (vec3(0.0f,0.0f,0.0f));
+	for (int i=0; i<draw_order.count(); i++)
+		draw_order[i]->draw_depth ();
+	store.draw_depth ();
+}
+
+// SceneSnapshot
+bool SceneSnapshot::update_geometry (Scene* scene) {
+	bool changed = instances.count() != scene->instances.count();
+	if (!changed) {
+		for (int i=0; i<instances.count(); i++) {
+			Instance* instance = scene->instances[i];
+			if (instances[i] != instance || parents[i] != instance->get_parent() || transforms[i*2] != instance->position || transforms[i*2+1] != instance->rotation) {
+				changed = true;
+				break;
+			}
+		}
+	}
+	if (changed) {
+		instances.clear ();
+		parents.clear ();
+		transforms.clear ();
+		for (int i=0; i<scene->instances.count(); i++) {
+			instances.append (scene->instances[i]);
+			parents.append (scene->instances[i]->get_parent());
+			transforms.append (scene->instances[i]->position);
+			transforms.append (scene->instances[i]->rotation);
+		}
+	}
+	
+	InstanceStore& store = scene->store;
+	bool store_changed = store_transforms.count() != store.count();
+	for (int i=0; !store_changed && i<store.count(); i++) {
+		store_changed = store_objects[i] != store.objects[i] || store_flags[i] != store.flags[i] || memcmp(store_transforms[i].m, store.transforms[i].m, sizeof(mat4)) != 0;
+	}
+	if (store_changed) {
+		store_transforms.clear ();
+		store_objects.clear ();
+		store_flags.clear ();
+		for (int i=0; i<store.count(); i++) {
+			store_transforms.append (store.transforms[i]);
+			store_objects.append (store.objects[i]);
+			store_flags.append (store.flags[i]);
+		}
+	}
+	return changed || store_changed;
+}
+bool SceneSnapshot::update_lights (Scene* scene) {
+	bool changed = lights.count() != scene->lights.count();
+	for (int i=0; !changed && i<lights.count(); i++)
+		changed = lights[i] != scene->lights[i].position;
+	if (changed) {
+		lights.clear ();
+		for (int i=0; i<scene->lights.count(); i++)
+			lights.append (scene->lights[i].position);
+	}
+	return changed;
 }
 
 // Camera
@@ -189,27 +727,34 @@ static float get_angle (float x, float y) {
 	else if (y>0) return atan (x/y);
 	else if (y<0) return atan (x/y) + M_PI;
 }
-void Camera::take_a_picture () {
-	glClear (GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+void Camera::apply_view () {
 	Projection::perspective (-0.4, 0.4, -0.4/width*height, 0.4/width*height, 1, 1000);
+	TextureStreamer::screen_scale = width / 0.8f;
 	
 	//glLoadIdentity ();
 	if (track) {
-		if (max_distance > 0.0f && length(track->position-position) > max_distance) {
-			vec3 direction = track->position - position;
+		scene->update_transforms ();
+		vec3 track_position = track->get_world_position ();
+		if (max_distance > 0.0f && length(track_position-position) > max_distance) {
+			vec3 direction = track_position - position;
 			float factor = (length(direction) - max_distance) / length(direction);
 			position += direction * factor;
 		}
-		float dx = track->position.x - position.x;
-		float dy = track->position.y - position.y;
-		float dz = track->position.z - position.z;
+		float dx = track_position.x - position.x;
+		float dy = track_position.y - position.y;
+		float dz = track_position.z - position.z;
 		float tilt = get_angle (-dy, sqrt(dx*dx+dz*dz)) * (180.0/M_PI); // down
 		float rotation = get_angle (dx, -dz) * (180.0/M_PI); // to the right
-		glRotatef (tilt, 1, 0, 0);
-		glRotatef (rotation, 0, 1, 0);
+		FixedFunction::multiply (mat4::rotation(tilt, vec3(1,0,0)) * mat4::rotation(rotation, vec3(0,1,0)));
 	}
-	glTranslatef (-position.x, -position.y, -position.z);
-	
+	FixedFunction::multiply (mat4::translation(-position));
+}
+void Camera::take_a_picture () {
+	glClear (GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+	if (Capture::active)
+		Capture::clear (GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+	apply_view ();
+	scene->sort (position);
 	scene->draw ();
 }
 void Camera::set_resolution (int width, int height) {
@@ -220,4 +765,343 @@ void Camera::look_at (float x, float y, float z) {
 	
 }
 
+// ViewSet
+void ViewSet::use (Program* program) {
+	// the matrices are set once per program and frame
+	for (int i=0; i<programs.count(); i++)
+		if (programs[i] == program)
+			return;
+	program->set_uniform_mat4 ("view_matrices", view_matrices, count);
+	program->set_uniform_mat4 ("projection_matrix", &projection);
+	programs.append (program);
+}
+
+// MultiViewCamera
+MultiViewCamera::MultiViewCamera (Scene* scene, int width, int height, int view_count): Camera(scene, width, height), field_of_view(90.0f), submitted_instances(0), view_instances(0) {
+	if (view_count > ViewSet::MAX_VIEWS) {
+		fprintf (stderr, "MultiViewCamera::MultiViewCamera: at most %d views are supported\n", ViewSet::MAX_VIEWS);
+		view_count = ViewSet::MAX_VIEWS;
+	}
+	views.count = view_count;
+	for (int i=0; i<view_count; i++)
+		views.view_matrices[i] = mat4::identity ();
+	target = new FramebufferObject (width, height, GL_RGBA8, view_count);
+}
+MultiViewCamera::~MultiViewCamera () {
+	delete target;
+}
+void MultiViewCamera::set_view (int view, const vec3& position, const vec3& target, const vec3& up) {
+	views.view_matrices[view] = mat4::look_at (position, target, up);
+}
+void MultiViewCamera::set_cube_map (const vec3& position) {
+	// +X, -X, +Y, -Y, +Z, -Z
+	static const vec3 directions[] = {vec3(1,0,0), vec3(-1,0,0), vec3(0,1,0), vec3(0,-1,0), vec3(0,0,1), vec3(0,0,-1)};
+	static const vec3 ups[] = {vec3(0,-1,0), vec3(0,-1,0), vec3(0,0,1), vec3(0,0,-1), vec3(0,-1,0), vec3(0,-1,0)};
+	field_of_view = 90.0f;
+	this->position = position;
+	for (int i=0; i<6 && i<views.count; i++)
+		set_view (i, position, position + directions[i], ups[i]);
+}
+Texture* MultiViewCamera::get_result () {
+	return target->color_texture;
+}
+unsigned int MultiViewCamera::get_view_mask (Instance* instance) {
+	Object* object = instance->get_object ();
+	vec3 center = instance->get_transform() * object->center;
+	float radius = object->radius;
+	float tx = tan (field_of_view * 0.5f * M_PI / 180.0);
+	float ty = tx * height / width;
+	float nx = 1.0f / sqrt (1.0f + tx*tx);
+	float ny = 1.0f / sqrt (1.0f + ty*ty);
+	unsigned int mask = 0;
+	for (int i=0; i<views.count; i++) {
+		// the sphere in eye space against the planes of the frustum
+		vec3 p = views.view_matrices[i] * center;
+		float depth = -p.z;
+		if (depth + radius < 1.0f || depth - radius > 1000.0f)
+			continue;
+		if ((fabs(p.x) - depth*tx) * nx > radius)
+			continue;
+		if ((fabs(p.y) - depth*ty) * ny > radius)
+			continue;
+		mask |= 1u << i;
+	}
+	return mask;
+}
+void MultiViewCamera::take_a_picture () {
+	float tx = tan (field_of_view * 0.5f * M_PI / 180.0);
+	float ty = tx * height / width;
+	views.projection = mat4::frustum (-tx, tx, -ty, ty, 1.0f, 1000.0f);
+	views.programs.clear ();
+	TextureStreamer::screen_scale = width / (2.0f * tx);
+	
+	target->bind ();
+	FixedFunction::push_matrix ();
+	
+	// a single traversal: the views are culled together and every visible
+	// instance is submitted once for all of them
+	scene->update_transforms ();
+	submitted_instances = 0;
+	view_instances = 0;
+	for (int i=0; i<scene->instances.count(); i++) {
+		Instance* instance = scene->instances[i];
+		if (!instance->get_object())
+			continue;
+		unsigned int mask = get_view_mask (instance);
+		if (mask == 0)
+			continue;
+		instance->draw_views (&views, mask);
+		submitted_instances++;
+		for (int j=0; j<views.count; j++)
+			if (mask & (1u << j)) view_instances++;
+	}
+	
+	FixedFunction::pop_matrix ();
+	target->unbind ();
+}
+
+// DynamicResolution
+DynamicResolution::DynamicResolution (float target_time, float min_scale, float max_scale): frame(0), target_time(target_time), min_scale(min_scale), max_scale(max_scale > 1.0f ? 1.0f : max_scale), scale(this->max_scale), gpu_time(0.0f), report(false) {
+	// the render targets are not reallocated, so the scale cannot exceed 1
+	glGenQueries (3, queries);
+	for (int i=0; i<3; i++)
+		pending[i] = false;
+}
+DynamicResolution::~DynamicResolution () {
+	glDeleteQueries (3, queries);
+}
+void DynamicResolution::begin_frame () {
+	glBeginQuery (GL_TIME_ELAPSED, queries[frame%3]);
+}
+void DynamicResolution::end_frame () {
+	glEndQuery (GL_TIME_ELAPSED);
+	pending[frame%3] = true;
+	frame++;
+	update ();
+	if (report)
+		printf ("DynamicResolution: frame %d, scale %.3f, GPU time %.2f ms\n", frame, scale, gpu_time);
+}
+void DynamicResolution::update () {
+	// read the oldest query, which is usually available without waiting
+	int oldest = frame % 3;
+	if (!pending[oldest])
+		return;
+	GLuint available;
+	glGetQueryObjectuiv (queries[oldest], GL_QUERY_RESULT_AVAILABLE, &available);
+	if (!available)
+		return;
+	GLuint64 elapsed;
+	glGetQueryObjectui64v (queries[oldest], GL_QUERY_RESULT, &elapsed);
+	pending[oldest] = false;
+	gpu_time = elapsed / 1000000.0f;
+	// the cost is roughly proportional to the number of pixels
+	float ratio = target_time / gpu_time;
+	if (ratio > 0.95f && ratio < 1.05f)
+		return;
+	float desired = scale * sqrt (ratio);
+	scale += (desired - scale) * 0.25f;
+	if (scale < min_scale) scale = min_scale;
+	if (scale > max_scale) scale = max_scale;
+}
+
+// DeferredRenderingCamera
+Program* DeferredRenderingCamera::upscale_program = NULL;
+DeferredRenderingCamera::DeferredRenderingCamera (Scene* scene, int width, int height): Camera(scene, width, height), overdraw_query_pending(false), overdraw_pixels(1), valid(false), cached_track(NULL), output(NULL), path(FULL), full_frames(0), lighting_only_frames(0), skipped_frames(0), depth_prepass(false), measure_overdraw(false), overdraw(0.0f), dynamic_resolution(NULL), sharpness(0.5f), bloom(NULL) {
+	// G-buffer: color, normal and eye space position
+	target = new FramebufferObject (width, height);
+	normal_texture = new Texture (width, height, GL_RGBA32F, "DeferredRenderingCamera normal");
+	position_texture = new Texture (width, height, GL_RGBA32F, "DeferredRenderingCamera position");
+	target->attach_texture (normal_texture);
+	target->attach_texture (position_texture);
+	result = new FramebufferObject (width, height);
+	glGenQueries (1, &overdraw_query);
+}
+DeferredRenderingCamera::~DeferredRenderingCamera () {
+	glDeleteQueries (1, &overdraw_query);
+	delete result;
+	delete target;
+	delete position_texture;
+	delete normal_texture;
+}
+void DeferredRenderingCamera::invalidate () {
+	valid = false;
+}
+void DeferredRenderingCamera::draw_geometry (float scale) {
+	// collect the overdraw of a previous frame without waiting for the GPU
+	if (overdraw_query_pending) {
+		GLuint available;
+		glGetQueryObjectuiv (overdraw_query, GL_QUERY_RESULT_AVAILABLE, &available);
+		if (available) {
+			GLuint samples;
+			glGetQueryObjectuiv (overdraw_query, GL_QUERY_RESULT, &samples);
+			overdraw = (float) samples / overdraw_pixels;
+			overdraw_query_pending = false;
+		}
+	}
+	bool measure = measure_overdraw && !overdraw_query_pending;
+	
+	glClearColor (0.0f, 0.0f, 0.0f, 0.0f);
+	target->bind ();
+	apply_view ();
+	TextureStreamer::screen_scale *= scale;
+	scene->sort (position);
+	if (depth_prepass) {
+		glColorMask (GL_FALSE, GL_FALSE, GL_FALSE, GL_FALSE);
+		scene->draw_depth ();
+		glColorMask (GL_TRUE, GL_TRUE, GL_TRUE, GL_TRUE);
+		glDepthFunc (GL_EQUAL);
+		glDepthMask (GL_FALSE);
+	}
+	if (measure)
+		glBeginQuery (GL_SAMPLES_PASSED, overdraw_query);
+	scene->draw ();
+	if (measure) {
+		glEndQuery (GL_SAMPLES_PASSED);
+		overdraw_query_pending = true;
+		overdraw_pixels = target->viewport_width * target->viewport_height;
+	}
+	if (depth_prepass) {
+		glDepthFunc (GL_LESS);
+		glDepthMask (GL_TRUE);
+	}
+	memcpy (view_matrix, FixedFunction::get_matrix(FixedFunction::MODELVIEW).m, sizeof(view_matrix));
+	target->unbind ();
+	
+	cached_position = position;
+	cached_track = track;
+	if (track)
+		cached_track_position = track->position;
+	valid = true;
+}
+void DeferredRenderingCamera::draw_lights (float scale, float s, float t) {
+	Projection::scale_texture_coordinates (s, t);
+	result->bind ();
+	target->color_texture->draw ();
+	glEnable (GL_BLEND);
+	glBlendFunc (GL_ONE, GL_ONE);
+	for (int i=0; i<scene->lights.count(); i++)
+		scene->lights[i].draw (target->color_texture, normal_texture, position_texture, view_matrix);
+	glDisable (GL_BLEND);
+	result->unbind ();
+	
+	output = result->color_texture;
+	if (bloom) {
+		bloom->apply (output, scale);
+		output = bloom->result->color_texture;
+	}
+}
+void DeferredRenderingCamera::take_a_picture () {
+	if (dynamic_resolution)
+		dynamic_resolution->begin_frame ();
+	// render into a part of the targets
+	float scale = dynamic_resolution ? dynamic_resolution->scale : 1.0f;
+	int viewport_width = target->viewport_width;
+	int viewport_height = target->viewport_height;
+	target->set_viewport (width * scale, height * scale);
+	result->set_viewport (width * scale, height * scale);
+	float s = (float) target->viewport_width / target->width;
+	float t = (float) target->viewport_height / target->height;
+	
+	// find out what has to be redrawn
+	bool geometry_changed = snapshot.update_geometry (scene);
+	bool lights_changed = snapshot.update_lights (scene);
+	if (position != cached_position || track != cached_track || (track && track->position != cached_track_position))
+		geometry_changed = true;
+	if (target->viewport_width != viewport_width || target->viewport_height != viewport_height)
+		geometry_changed = true;
+	// finer texture levels have arrived
+	if (TextureStreamer::streamed > 0)
+		geometry_changed = true;
+	if (!valid)
+		geometry_changed = true;
+	if (geometry_changed)
+		path = FULL;
+	else if (lights_changed)
+		path = LIGHTING_ONLY;
+	else
+		path = SKIPPED;
+	
+	if (path == FULL) {
+		draw_geometry (scale);
+		full_frames++;
+	}
+	if (path == FULL || path == LIGHTING_ONLY) {
+		draw_lights (scale, s, t);
+		if (path == LIGHTING_ONLY)
+			lighting_only_frames++;
+	}
+	else {
+		skipped_frames++;
+	}
+	
+	// upscale the result to the output resolution
+	glViewport (0, 0, width, height);
+	Projection::scale_texture_coordinates (s, t);
+	if (s < 1.0f || t < 1.0f) {
+		if (!upscale_program) {
+			upscale_program = new Program ("shaders/vertex_shader.glsl", "shaders/upscale_sharpen.glsl");
+			upscale_program->set_persistent ();
+		}
+		upscale_program->use ();
+		upscale_program->set_uniform_vec3 ("texel", vec3(1.0f/output->width, 1.0f/output->height, 0.0f));
+		upscale_program->set_uniform_vec3 ("limit", vec3(s - 0.5f/output->width, t - 0.5f/output->height, 0.0f));
+		upscale_program->set_uniform_float ("sharpness", sharpness);
+		output->draw (upscale_program);
+	}
+	else {
+		output->draw ();
+	}
+	Projection::scale_texture_coordinates (1.0f, 1.0f);
+	if (dynamic_resolution)
+		dynamic_resolution->end_frame ();
+}
+
+// BloomEffect
+Program* BloomEffect::program = NULL;
+Program* BloomEffect::combine_program = NULL;
+BloomEffect::BloomEffect (int width, int height) {
+	intermediate_result = new FramebufferObject (width, height);
+	result = new FramebufferObject (width, height);
+}
+BloomEffect::~BloomEffect () {
+	delete result;
+	delete intermediate_result;
+}
+void BloomEffect::apply (Texture* input, float scale) {
+	if (!program) {
+		program = new Program ("shaders/vertex_shader.glsl", "shaders/bloom_blur.glsl");
+		program->set_persistent ();
+		combine_program = new Program ("shaders/vertex_shader.glsl", "shaders/bloom_combine.glsl");
+		combine_program->set_persistent ();
+	}
+	// the blur samples the input and the intermediate result with the same
+	// coordinates, which only works if they have the same size
+	if (input->width != result->width || input->height != result->height)
+		printf ("BloomEffect::apply: the input is %dx%d, the targets are %dx%d\n", input->width, input->height, result->width, result->height);
+	intermediate_result->set_viewport (input->width * scale, input->height * scale);
+	result->set_viewport (input->width * scale, input->height * scale);
+	float s = (float) (int) (input->width * scale) / input->width;
+	float t = (float) (int) (input->height * scale) / input->height;
+	vec3 limit (s - 0.5f/input->width, t - 0.5f/input->height, 0.0f);
+	Projection::scale_texture_coordinates (s, t);
+	
+	// horizontal blur of the bright parts
+	intermediate_result->bind ();
+	program->use ();
+	program->set_uniform_vec3 ("step", vec3(1.0f/input->width, 0.0f, 0.0f));
+	program->set_uniform_vec3 ("limit", limit);
+	input->draw (program);
+	intermediate_result->unbind ();
+	
+	// vertical blur, added to the input
+	result->bind ();
+	combine_program->use ();
+	combine_program->set_uniform_vec3 ("step", vec3(0.0f, 1.0f/input->height, 0.0f));
+	combine_program->set_uniform_vec3 ("limit", limit);
+	draw_2_textures (input, intermediate_result->color_texture, combine_program);
+	result->unbind ();
+	
+	Projection::scale_texture_coordinates (1.0f, 1.0f);
+}
+
 }
@@ -9,29 +9,312 @@ All rights reserved.
 #include "infra.hpp"
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <time.h>
 #include <SOIL/SOIL.h>
 
+// Backend
+Backend::Type Backend::type = Backend::LEGACY;
+Backend::Type Backend::select (Type requested) {
+	type = LEGACY;
+	if (requested == CORE) {
+		GLint major = 0, minor = 0, profile = 0;
+		glGetIntegerv (GL_MAJOR_VERSION, &major);
+		glGetIntegerv (GL_MINOR_VERSION, &minor);
+		glGetIntegerv (GL_CONTEXT_PROFILE_MASK, &profile);
+		if ((major > 4 || (major == 4 && minor >= 5)) && (profile & GL_CONTEXT_CORE_PROFILE_BIT))
+			type = CORE;
+		else
+			fprintf (stderr, "Backend::select: the context is OpenGL %d.%d without the core profile, falling back to the legacy backend\n", major, minor);
+	}
+	printf ("Backend::select: using the %s backend\n", type == CORE ? "core" : "legacy");
+	return type;
+}
+
+// FixedFunction
+static const GLenum matrix_modes[] = {GL_PROJECTION, GL_MODELVIEW, GL_TEXTURE};
+static List<mat4> matrix_stacks[3];
+static FixedFunction::MatrixMode current_matrix_mode = FixedFunction::MODELVIEW;
+static GLfloat current_color[4] = {1.0f, 1.0f, 1.0f, 1.0f};
+// incremented on every change, a program remembers the version it was drawn with
+static int fixed_function_version = 0;
+static const char* fixed_function_uniforms[] = {"core_projection_matrix", "core_modelview_matrix", "core_normal_matrix", "core_texture_matrix", "core_color"};
+static mat4& get_top (FixedFunction::MatrixMode mode) {
+	List<mat4>& stack = matrix_stacks[mode];
+	if (stack.count() == 0)
+		stack.append (mat4::identity());
+	return stack[stack.count()-1];
+}
+// the inverse transpose of the upper left 3x3 matrix, like gl_NormalMatrix
+static void get_normal_matrix (const mat4& matrix, GLfloat* n) {
+	const float* m = matrix.m;
+	for (int column=0; column<3; column++) {
+		int c1 = (column+1) % 3;
+		int c2 = (column+2) % 3;
+		for (int row=0; row<3; row++) {
+			int r1 = (row+1) % 3;
+			int r2 = (row+2) % 3;
+			n[column*3+row] = m[c1*4+r1]*m[c2*4+r2] - m[c2*4+r1]*m[c1*4+r2];
+		}
+	}
+	float determinant = m[0]*n[0] + m[4]*n[3] + m[8]*n[6];
+	if (determinant != 0.0f) {
+		for (int i=0; i<9; i++)
+			n[i] /= determinant;
+	}
+}
+void FixedFunction::matrix_mode (MatrixMode mode) {
+	current_matrix_mode = mode;
+	if (Backend::type == Backend::LEGACY) {
+		if (mode == TEXTURE)
+			glActiveTexture (GL_TEXTURE0);
+		glMatrixMode (matrix_modes[mode]);
+	}
+}
+void FixedFunction::load_identity () {
+	get_top (current_matrix_mode) = mat4::identity ();
+	fixed_function_version++;
+	if (Backend::type == Backend::LEGACY)
+		glLoadIdentity ();
+}
+void FixedFunction::load_matrix (const mat4& matrix) {
+	get_top (current_matrix_mode) = matrix;
+	fixed_function_version++;
+	if (Backend::type == Backend::LEGACY)
+		glLoadMatrixf (matrix.m);
+}
+void FixedFunction::multiply (const mat4& matrix) {
+	mat4& top = get_top (current_matrix_mode);
+	top = top * matrix;
+	fixed_function_version++;
+	if (Backend::type == Backend::LEGACY)
+		glMultMatrixf (matrix.m);
+}
+void FixedFunction::push_matrix () {
+	mat4 top = get_top (current_matrix_mode);
+	matrix_stacks[current_matrix_mode].append (top);
+	if (Backend::type == Backend::LEGACY)
+		glPushMatrix ();
+}
+void FixedFunction::pop_matrix () {
+	List<mat4>& stack = matrix_stacks[current_matrix_mode];
+	if (stack.count() > 1)
+		stack.remove_last ();
+	fixed_function_version++;
+	if (Backend::type == Backend::LEGACY)
+		glPopMatrix ();
+}
+const mat4& FixedFunction::get_matrix (MatrixMode mode) {
+	return get_top (mode);
+}
+void FixedFunction::set_color (float r, float g, float b, float a) {
+	current_color[0] = r;
+	current_color[1] = g;
+	current_color[2] = b;
+	current_color[3] = a;
+	fixed_function_version++;
+	if (Backend::type == Backend::LEGACY)
+		glColor4f (r, g, b, a);
+}
+void FixedFunction::apply (Program* program) {
+	if (!program || program->fixed_function_version == fixed_function_version)
+		return;
+	GLint* locations = program->fixed_function_locations;
+	if (!program->fixed_function_located) {
+		for (int i=0; i<5; i++)
+			locations[i] = glGetUniformLocation (program->identifier, fixed_function_uniforms[i]);
+		program->fixed_function_located = true;
+	}
+	const mat4& modelview = get_top (MODELVIEW);
+	glProgramUniformMatrix4fv (program->identifier, locations[0], 1, GL_FALSE, get_top(PROJECTION).m);
+	glProgramUniformMatrix4fv (program->identifier, locations[1], 1, GL_FALSE, modelview.m);
+	if (locations[2] >= 0) {
+		GLfloat normal_matrix[9];
+		get_normal_matrix (modelview, normal_matrix);
+		glProgramUniformMatrix3fv (program->identifier, locations[2], 1, GL_FALSE, normal_matrix);
+	}
+	glProgramUniformMatrix4fv (program->identifier, locations[3], 1, GL_FALSE, get_top(TEXTURE).m);
+	glProgramUniform4fv (program->identifier, locations[4], 1, current_color);
+	program->fixed_function_version = fixed_function_version;
+}
+
 // Projection
 void Projection::perspective (double left, double right, double bottom, double top, double near, double far) {
-	glMatrixMode (GL_PROJECTION);
-	glLoadIdentity ();
-	glFrustum (left, right, bottom, top, near, far);
-	glMatrixMode (GL_MODELVIEW);
-	glLoadIdentity ();
+	FixedFunction::matrix_mode (FixedFunction::PROJECTION);
+	FixedFunction::load_matrix (mat4::frustum(left, right, bottom, top, near, far));
+	FixedFunction::matrix_mode (FixedFunction::MODELVIEW);
+	FixedFunction::load_identity ();
 }
 void Projection::orthographic (double left, double right, double bottom, double top, double near, double far) {
-	glMatrixMode (GL_PROJECTION);
-	glLoadIdentity ();
-	glOrtho (left, right, bottom, top, near, far);
-	glMatrixMode (GL_MODELVIEW);
-	glLoadIdentity ();
+	FixedFunction::matrix_mode (FixedFunction::PROJECTION);
+	FixedFunction::load_matrix (mat4::orthographic(left, right, bottom, top, near, far));
+	FixedFunction::matrix_mode (FixedFunction::MODELVIEW);
+	FixedFunction::load_identity ();
+}
+void Projection::scale_texture_coordinates (float s, float t) {
+	FixedFunction::matrix_mode (FixedFunction::TEXTURE);
+	FixedFunction::load_matrix (mat4::scale(vec3(s, t, 1.0f)));
+	FixedFunction::matrix_mode (FixedFunction::MODELVIEW);
+}
+
+// ResourceManager
+struct Resource {
+	ResourceManager::Category category;
+	size_t size;
+	char tag[64];
+	bool alive;
+	bool persistent;
+};
+static List<Resource> resources;
+static List<int> free_resources;
+static size_t resource_totals[ResourceManager::CATEGORY_COUNT];
+static int resource_counts[ResourceManager::CATEGORY_COUNT];
+static size_t resource_high_water_mark = 0;
+static const char* category_names[] = {"Texture", "Buffer", "FramebufferObject", "Shader", "Program", "VertexArray"};
+int ResourceManager::add (Category category, size_t size, const char* tag) {
+	if (resources.count() == 0)
+		atexit (print_leaks);
+	Resource r;
+	r.category = category;
+	r.size = 0;
+	strncpy (r.tag, tag ? tag : "", sizeof(r.tag)-1);
+	r.tag[sizeof(r.tag)-1] = '\0';
+	r.alive = true;
+	r.persistent = false;
+	int resource;
+	if (free_resources.count() > 0) {
+		resource = free_resources[free_resources.count()-1];
+		free_resources.remove_last ();
+		resources[resource] = r;
+	}
+	else {
+		resource = resources.count ();
+		resources.append (r);
+	}
+	resource_counts[category]++;
+	resize (resource, size);
+	return resource;
+}
+void ResourceManager::resize (int resource, size_t size) {
+	if (resource < 0)
+		return;
+	Resource& r = resources[resource];
+	resource_totals[r.category] += size - r.size;
+	r.size = size;
+	size_t total = get_total ();
+	if (total > resource_high_water_mark)
+		resource_high_water_mark = total;
+}
+void ResourceManager::remove (int resource) {
+	if (resource < 0 || !resources[resource].alive)
+		return;
+	resize (resource, 0);
+	resources[resource].alive = false;
+	resource_counts[resources[resource].category]--;
+	free_resources.append (resource);
+}
+void ResourceManager::set_persistent (int resource) {
+	if (resource >= 0)
+		resources[resource].persistent = true;
+}
+int ResourceManager::get_count (Category category) {
+	return resource_counts[category];
+}
+size_t ResourceManager::get_total (Category category) {
+	return resource_totals[category];
+}
+size_t ResourceManager::get_total () {
+	size_t total = 0;
+	for (int i=0; i<CATEGORY_COUNT; i++)
+		total += resource_totals[i];
+	return total;
+}
+size_t ResourceManager::get_high_water_mark () {
+	return resource_high_water_mark;
+}
+void ResourceManager::print_statistics () {
+	printf ("ResourceManager::print_statistics:\n");
+	for (int i=0; i<CATEGORY_COUNT; i++)
+		printf ("  %-18s %6d %10.2f MiB\n", category_names[i], resource_counts[i], resource_totals[i] / 1048576.0);
+	printf ("  total %.2f MiB, high-water mark %.2f MiB\n", get_total() / 1048576.0, resource_high_water_mark / 1048576.0);
+}
+void ResourceManager::print_leaks () {
+	int leaks = 0;
+	for (int i=0; i<resources.count(); i++) {
+		if (resources[i].alive && !resources[i].persistent) {
+			fprintf (stderr, "ResourceManager: leaked %s \"%s\" (%lu bytes)\n", category_names[resources[i].category], resources[i].tag, (unsigned long)resources[i].size);
+			leaks++;
+		}
+	}
+	if (leaks)
+		fprintf (stderr, "ResourceManager: %d resources leaked, high-water mark %.2f MiB\n", leaks, resource_high_water_mark / 1048576.0);
 }
 
 // Texture
 Program* Texture::program = NULL;
-Texture::Texture (const char* filename) {
+static unsigned char* load_image (const char* filename, DecodedImages* images, int* width, int* height);
+size_t Texture::get_size (int width, int height, GLenum format) {
+	size_t bytes_per_pixel;
+	switch (format) {
+		case GL_RGB: case GL_RGB8: bytes_per_pixel = 3; break;
+		case GL_RGBA: case GL_RGBA8: bytes_per_pixel = 4; break;
+		case GL_RGB16F: bytes_per_pixel = 6; break;
+		case GL_RGBA16F: bytes_per_pixel = 8; break;
+		case GL_RGB32F: bytes_per_pixel = 12; break;
+		case GL_RGBA32F: bytes_per_pixel = 16; break;
+		case GL_DEPTH_COMPONENT: case GL_DEPTH_COMPONENT24: bytes_per_pixel = 3; break;
+		case GL_DEPTH_COMPONENT32F: bytes_per_pixel = 4; break;
+		default: bytes_per_pixel = 4; break;
+	}
+	return (size_t)width * height * bytes_per_pixel;
+}
+Texture::Texture (const char* filename, bool streamed, DecodedImages* images): texture_unit(0), stream(NULL), target(GL_TEXTURE_2D), width(0), height(0), layers(1) {
 	if (!program) {
 		program = new Program ("shaders/vertex_shader.glsl", "shaders/texture_passthrough.glsl");
+		program->set_persistent ();
+	}
+	if (streamed && TextureStreamer::enabled) {
+		load_streamed (filename, images);
+		return;
+	}
+	GLint format = GL_RGBA;
+	if (Backend::type == Backend::CORE) {
+		// immutable storage, SOIL only knows the bind-to-edit path
+		glCreateTextures (GL_TEXTURE_2D, 1, &identifier);
+		unsigned char* data = load_image (filename, images, &width, &height);
+		if (data) {
+			format = GL_RGBA8;
+			glTextureStorage2D (identifier, 1, GL_RGBA8, width, height);
+			glTextureSubImage2D (identifier, 0, 0, 0, width, height, GL_RGBA, GL_UNSIGNED_BYTE, data);
+			glTextureParameteri (identifier, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+			glTextureParameteri (identifier, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+			glTextureParameteri (identifier, GL_TEXTURE_WRAP_S, GL_REPEAT);
+			glTextureParameteri (identifier, GL_TEXTURE_WRAP_T, GL_REPEAT);
+			glTextureParameterf (identifier, GL_TEXTURE_MAX_ANISOTROPY_EXT, 4.0f);
+			Error::label (GL_TEXTURE, identifier, filename);
+			free (data);
+		}
+		else
+			fprintf (stderr, "Texture::Texture(): failed to load %s: %s\n", filename, SOIL_last_result());
+		resource = ResourceManager::add (ResourceManager::TEXTURE, get_size(width, height, format), filename);
+		return;
+	}
+	unsigned char* data = images ? images->take (filename, &width, &height) : NULL;
+	if (data) {
+		glGenTextures (1, &identifier);
+		glBindTexture (GL_TEXTURE_2D, identifier);
+		glTexImage2D (GL_TEXTURE_2D, 0, GL_RGBA8, width, height, 0, GL_RGBA, GL_UNSIGNED_BYTE, data);
+		glTexParameteri (GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+		glTexParameteri (GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+		glTexParameteri (GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
+		glTexParameteri (GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
+		glTexParameterf (GL_TEXTURE_2D, GL_TEXTURE_MAX_ANISOTROPY_EXT, 4.0f);
+		Error::label (GL_TEXTURE, identifier, filename);
+		glBindTexture (GL_TEXTURE_2D, 0);
+		free (data);
+		resource = ResourceManager::add (ResourceManager::TEXTURE, get_size(width, height, GL_RGBA8), filename);
+		return;
 	}
 	identifier = SOIL_load_OGL_texture (filename, SOIL_LOAD_AUTO, SOIL_CREATE_NEW_ID, SOIL_FLAG_INVERT_Y|SOIL_FLAG_TEXTURE_REPEATS);
 	if (identifier==0)
@@ -39,72 +322,173 @@ Texture::Texture (const char* filename) {
 	// anisotropic filtering
 	glBindTexture (GL_TEXTURE_2D, identifier);
 	glTexParameterf (GL_TEXTURE_2D, GL_TEXTURE_MAX_ANISOTROPY_EXT, 4.0f);
+	if (identifier) {
+		glGetTexLevelParameteriv (GL_TEXTURE_2D, 0, GL_TEXTURE_WIDTH, &width);
+		glGetTexLevelParameteriv (GL_TEXTURE_2D, 0, GL_TEXTURE_HEIGHT, &height);
+		glGetTexLevelParameteriv (GL_TEXTURE_2D, 0, GL_TEXTURE_INTERNAL_FORMAT, &format);
+		Error::label (GL_TEXTURE, identifier, filename);
+	}
 	glBindTexture (GL_TEXTURE_2D, 0);
+	resource = ResourceManager::add (ResourceManager::TEXTURE, get_size(width, height, format), filename);
+}
+// the pixel format and type to allocate an internal format with
+static bool get_pixel_format (GLenum internal_format, GLenum* format, GLenum* type) {
+	switch (internal_format) {
+		// RGB
+		case GL_RGB: case GL_RGB8: *format = GL_RGB; *type = GL_UNSIGNED_BYTE; return true;
+		// RGBA
+		case GL_RGBA: case GL_RGBA8: *format = GL_RGBA; *type = GL_UNSIGNED_BYTE; return true;
+		// 32 bit floating point
+		case GL_RGB32F: *format = GL_RGB; *type = GL_FLOAT; return true;
+		case GL_RGBA32F: *format = GL_RGBA; *type = GL_FLOAT; return true;
+		// 16 bit floating point
+		// depth
+		case GL_DEPTH_COMPONENT: *format = GL_DEPTH_COMPONENT; *type = GL_UNSIGNED_BYTE; return true;
+		case GL_DEPTH_COMPONENT32F: *format = GL_DEPTH_COMPONENT; *type = GL_FLOAT; return true;
+		default: return false;
+	}
+}
+// immutable storage needs a sized format
+static GLenum get_sized_format (GLenum format) {
+	switch (format) {
+		case GL_RGB: return GL_RGB8;
+		case GL_RGBA: return GL_RGBA8;
+		case GL_DEPTH_COMPONENT: return GL_DEPTH_COMPONENT24;
+		default: return format;
+	}
 }
-Texture::Texture (int width, int height, GLenum format): width(width), height(height), texture_unit(0) {
+Texture::Texture (int width, int height, GLenum format, const char* tag): texture_unit(0), stream(NULL), target(GL_TEXTURE_2D), width(width), height(height), layers(1) {
 	// formats: GL_RGB8 (GL_RGB), GL_RGBA8 (GL_RGBA), GL_RGBA16F, GL_RGBA32F
 	if (!program) {
 		program = new Program ("shaders/vertex_shader.glsl", "shaders/texture_passthrough.glsl");
+		program->set_persistent ();
 	}
-	Error::print ("before Texture::Texture");
-	glGenTextures (1, &identifier);
-	glBindTexture (GL_TEXTURE_2D, identifier);
-	glTexParameteri (GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-	glTexParameteri (GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
-	// RGB
-	if (format == GL_RGB)
-		glTexImage2D (GL_TEXTURE_2D, 0, GL_RGB, width, height, 0, GL_RGB, GL_UNSIGNED_BYTE, NULL);
-	// RGBA
-	else if (format == GL_RGBA)
-		glTexImage2D (GL_TEXTURE_2D, 0, GL_RGBA, width, height, 0, GL_RGBA, GL_UNSIGNED_BYTE, NULL);
-	// 32 bit floating point
-	else if (format == GL_RGB32F)
-		glTexImage2D (GL_TEXTURE_2D, 0, GL_RGB32F, width, height, 0, GL_RGB, GL_FLOAT, NULL);
-	else if (format == GL_RGBA32F)
-		glTexImage2D (GL_TEXTURE_2D, 0, GL_RGBA32F, width, height, 0, GL_RGBA, GL_FLOAT, NULL);
-	// 16 bit floating point
-	// depth
-	else if (format == GL_DEPTH_COMPONENT)
-		glTexImage2D (GL_TEXTURE_2D, 0, GL_DEPTH_COMPONENT, width, height, 0, GL_DEPTH_COMPONENT, GL_UNSIGNED_BYTE, NULL);
-	else if (format == GL_DEPTH_COMPONENT32F)
-		glTexImage2D (GL_TEXTURE_2D, 0, GL_DEPTH_COMPONENT32F, width, height, 0, GL_DEPTH_COMPONENT, GL_FLOAT, NULL);
-	else
-		printf ("Texture::Texture: this format is not yet supported\n");
-	glBindTexture (GL_TEXTURE_2D, 0);
-	Error::print ("Texture::Texture");
+	if (Backend::type == Backend::CORE) {
+		glCreateTextures (GL_TEXTURE_2D, 1, &identifier);
+		glTextureParameteri (identifier, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+		glTextureParameteri (identifier, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+		glTextureStorage2D (identifier, 1, get_sized_format(format), width, height);
+	}
+	else {
+		glGenTextures (1, &identifier);
+		glBindTexture (GL_TEXTURE_2D, identifier);
+		glTexParameteri (GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+		glTexParameteri (GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+		GLenum pixel_format, type;
+		if (get_pixel_format (format, &pixel_format, &type))
+			glTexImage2D (GL_TEXTURE_2D, 0, format, width, height, 0, pixel_format, type, NULL);
+		else
+			printf ("Texture::Texture: this format is not yet supported\n");
+		glBindTexture (GL_TEXTURE_2D, 0);
+	}
+	Error::label (GL_TEXTURE, identifier, tag);
+	resource = ResourceManager::add (ResourceManager::TEXTURE, get_size(width, height, format), tag);
+}
+Texture::Texture (int width, int height, int layers, GLenum format, const char* tag): texture_unit(0), stream(NULL), target(GL_TEXTURE_2D_ARRAY), width(width), height(height), layers(layers) {
+	if (Backend::type == Backend::CORE) {
+		glCreateTextures (GL_TEXTURE_2D_ARRAY, 1, &identifier);
+		glTextureParameteri (identifier, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+		glTextureParameteri (identifier, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+		glTextureStorage3D (identifier, 1, get_sized_format(format), width, height, layers);
+	}
+	else {
+		glGenTextures (1, &identifier);
+		glBindTexture (GL_TEXTURE_2D_ARRAY, identifier);
+		glTexParameteri (GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+		glTexParameteri (GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+		GLenum pixel_format, type;
+		if (get_pixel_format (format, &pixel_format, &type))
+			glTexImage3D (GL_TEXTURE_2D_ARRAY, 0, format, width, height, layers, 0, pixel_format, type, NULL);
+		else
+			printf ("Texture::Texture: this format is not yet supported\n");
+		glBindTexture (GL_TEXTURE_2D_ARRAY, 0);
+	}
+	Error::label (GL_TEXTURE, identifier, tag);
+	resource = ResourceManager::add (ResourceManager::TEXTURE, get_size(width, height, format) * layers, tag);
 }
 Texture::~Texture () {
+	if (stream)
+		unload_streamed ();
+	ResourceManager::remove (resource);
 	glDeleteTextures (1, &identifier);
 }
 void Texture::bind (int texture_unit) {
 	this->texture_unit = texture_unit;
-	glActiveTexture (GL_TEXTURE0 + texture_unit);
-	glBindTexture (GL_TEXTURE_2D, identifier);
+	if (Backend::type == Backend::CORE)
+		glBindTextureUnit (texture_unit, identifier);
+	else {
+		glActiveTexture (GL_TEXTURE0 + texture_unit);
+		glBindTexture (target, identifier);
+	}
+	if (Capture::active)
+		Capture::bind_texture (texture_unit, target, identifier);
 }
 void Texture::unbind () {
-	glActiveTexture (GL_TEXTURE0 + texture_unit);
-	glBindTexture (GL_TEXTURE_2D, 0);
+	if (Backend::type == Backend::CORE)
+		glBindTextureUnit (texture_unit, 0);
+	else {
+		glActiveTexture (GL_TEXTURE0 + texture_unit);
+		glBindTexture (target, 0);
+	}
+	if (Capture::active)
+		Capture::bind_texture (texture_unit, target, 0);
+}
+
+// the screen-space drawing below uses a quad from client arrays with the
+// legacy backend and a static vertex array with the core backend
+static const GLint unit_square[] = {
+	0, 0,
+	1, 0,
+	1, 1,
+	0, 1
+};
+static void draw_quad (GLenum type, const void* vertices) {
+	glEnableClientState (GL_VERTEX_ARRAY);
+	glEnableClientState (GL_TEXTURE_COORD_ARRAY);
+	glVertexPointer (2, type, 0, vertices);
+	glTexCoordPointer (2, GL_INT, 0, unit_square);
+	draw_arrays (GL_QUADS, 0, 4);
+	glDisableClientState (GL_VERTEX_ARRAY);
+	glDisableClientState (GL_TEXTURE_COORD_ARRAY);
+}
+// a triangle that covers the unit square, followed by the unit square as a
+// triangle strip; the positions double as texture coordinates
+static Buffer* static_buffer = NULL;
+static VertexArray* static_vertices = NULL;
+static void draw_static_vertices (GLenum mode, int first, int count) {
+	if (!static_vertices) {
+		GLfloat coordinates[] = {
+			0, 0,  2, 0,  0, 2,
+			0, 0,  1, 0,  0, 1,  1, 1
+		};
+		static_buffer = new Buffer (sizeof(coordinates), "static vertices");
+		static_buffer->set_data (0, sizeof(coordinates), coordinates);
+		static_vertices = new VertexArray ("static vertices");
+		static_vertices->set_attribute (Backend::VERTEX, static_buffer, 0, 2*sizeof(GLfloat), 2);
+		static_vertices->set_attribute (Backend::TEX_COORD, static_buffer, 0, 2*sizeof(GLfloat), 2);
+		static_buffer->set_persistent ();
+		static_vertices->set_persistent ();
+	}
+	static_vertices->bind ();
+	draw_arrays (mode, first, count);
+	static_vertices->unbind ();
 }
+// covers the unit square of an orthographic (0, 1, 0, 1) projection
+static void draw_fullscreen () {
+	if (Backend::type == Backend::CORE)
+		draw_static_vertices (GL_TRIANGLES, 0, 3);
+	else
+		draw_quad (GL_INT, unit_square);
+}
+
 void Texture::draw (Program* p) {
 	if (!program) {
 		program = new Program ("shaders/vertex_shader.glsl", "shaders/texture_passthrough.glsl");
+		program->set_persistent ();
 	}
 	
-	GLint vertices[] = {
-		0, 0,
-		1, 0,
-		1, 1,
-		0, 1
-	};
-	GLint tex_coords[] = {
-		0, 0,
-		1, 0,
-		1, 1,
-		0, 1
-	};
-	
 	Projection::orthographic (0, 1, 0, 1, -1, 1);
-	glLoadIdentity ();
+	FixedFunction::load_identity ();
 	
 	// enable stuff
 	if (p) {
@@ -115,20 +499,14 @@ void Texture::draw (Program* p) {
 		program->use ();
 		program->set_uniform_int ("texture", 0);
 	}
-	glEnableClientState (GL_VERTEX_ARRAY);
-	glEnableClientState (GL_TEXTURE_COORD_ARRAY);
 	bind ();
-	glVertexPointer (2, GL_INT, 0, vertices);
-	glTexCoordPointer (2, GL_INT, 0, tex_coords);
 	glDisable (GL_DEPTH_TEST);
 	
 	// draw
-	glDrawArrays (GL_QUADS, 0, 4);
+	draw_fullscreen ();
 	
 	// disable stuff:
 	unbind ();
-	glDisableClientState (GL_VERTEX_ARRAY);
-	glDisableClientState (GL_TEXTURE_COORD_ARRAY);
 	glEnable (GL_DEPTH_TEST);
 }
 void Texture::draw (float x, float y, float w, float h) {
@@ -137,78 +515,67 @@ void Texture::draw (float x, float y, float w, float h) {
 	
 	if (!program) {
 		program = new Program ("shaders/vertex_shader.glsl", "shaders/texture_passthrough.glsl");
+		program->set_persistent ();
 	}
 	
-	GLfloat vertices[] = {
-		x, y,
-		x+w, y,
-		x+w, y+h,
-		x, y+h
-	};
-	GLfloat tex_coords[] = {
-		0, 0,
-		1, 0,
-		1, 1,
-		0, 1
-	};
-	
 	Projection::orthographic (0, 1, 0, 1, -1, 1);
 	//glLoadIdentity ();
 	
 	// enable stuff
 	program->use ();
 	program->set_uniform_int ("texture", 0);
-	glEnableClientState (GL_VERTEX_ARRAY);
-	glEnableClientState (GL_TEXTURE_COORD_ARRAY);
 	bind ();
-	glVertexPointer (2, GL_FLOAT, 0, vertices);
-	glTexCoordPointer (2, GL_FLOAT, 0, tex_coords);
 	glDisable (GL_DEPTH_TEST);
 	
 	// draw
-	glDrawArrays (GL_QUADS, 0, 4);
+	if (Backend::type == Backend::CORE) {
+		FixedFunction::multiply (mat4::translation(vec3(x, y, 0.0f)) * mat4::scale(vec3(w, h, 1.0f)));
+		draw_static_vertices (GL_TRIANGLE_STRIP, 3, 4);
+	}
+	else {
+		GLfloat vertices[] = {
+			x, y,
+			x+w, y,
+			x+w, y+h,
+			x, y+h
+		};
+		draw_quad (GL_FLOAT, vertices);
+	}
 	
 	// disable stuff:
 	unbind ();
-	glDisableClientState (GL_VERTEX_ARRAY);
-	glDisableClientState (GL_TEXTURE_COORD_ARRAY);
 	glEnable (GL_DEPTH_TEST);
 }
 void Texture::get_data (void* data) {
-	glGetTexImage (GL_TEXTURE_2D, 0, GL_RGB, GL_FLOAT, data);
+	if (Backend::type == Backend::CORE)
+		glGetTextureImage (identifier, 0, GL_RGB, GL_FLOAT, width*height*3*sizeof(GLfloat), data);
+	else
+		glGetTexImage (GL_TEXTURE_2D, 0, GL_RGB, GL_FLOAT, data);
 }
 void Texture::debug_print () {
 	GLfloat* buffer = (GLfloat*) malloc (width*height*4*sizeof(GLfloat));
-	glBindTexture (GL_TEXTURE_2D, identifier);
-	glGetTexImage (GL_TEXTURE_2D, 0, GL_RGBA, GL_FLOAT, buffer);
-	glBindTexture (GL_TEXTURE_2D, 0);
+	if (Backend::type == Backend::CORE)
+		glGetTextureImage (identifier, 0, GL_RGBA, GL_FLOAT, width*height*4*sizeof(GLfloat), buffer);
+	else {
+		glBindTexture (GL_TEXTURE_2D, identifier);
+		glGetTexImage (GL_TEXTURE_2D, 0, GL_RGBA, GL_FLOAT, buffer);
+		glBindTexture (GL_TEXTURE_2D, 0);
+	}
 	int index = height*3/4*width + width/2;
 	printf ("Texture::debug_print: {%f, %f, %f, %f}\n", buffer[index], buffer[index+1], buffer[index+2], buffer[index+3]);
 	free (buffer);
 }
 
+void draw_arrays (GLenum mode, int first, int count, int instances) {
+	if (Backend::type == Backend::CORE)
+		FixedFunction::apply (Program::current);
+	Capture::draw_arrays (mode, first, count, instances);
+}
 void draw_2_textures (Texture* t1, Texture* t2, Program* p) {
-	GLint vertices[] = {
-		0, 0,
-		1, 0,
-		1, 1,
-		0, 1
-	};
-	GLint tex_coords[] = {
-		0, 0,
-		1, 0,
-		1, 1,
-		0, 1
-	};
-	
 	Projection::orthographic (0, 1, 0, 1, -1, 1);
 	
 	// enable stuff
 	if (p) p->use ();
-	glEnableClientState (GL_VERTEX_ARRAY);
-	glEnableClientState (GL_TEXTURE_COORD_ARRAY);
-	glVertexPointer (2, GL_INT, 0, vertices);
-	glTexCoordPointer (2, GL_INT, 0, tex_coords);
 	glDisable (GL_DEPTH_TEST);
 	
 	// bind textures
@@ -218,7 +585,7 @@ void draw_2_textures (Texture* t1, Texture* t2, Program* p) {
 	p->set_uniform_int ("t2", 1);
 	
 	// draw
-	glDrawArrays (GL_QUADS, 0, 4);
+	draw_fullscreen ();
 	
 	// unbind textures
 //	glActiveTexture (GL_TEXTURE1);
@@ -227,32 +594,13 @@ void draw_2_textures (Texture* t1, Texture* t2, Program* p) {
 	t1->unbind ();
 	
 	// disable stuff:
-	glDisableClientState (GL_VERTEX_ARRAY);
-	glDisableClientState (GL_TEXTURE_COORD_ARRAY);
 	glEnable (GL_DEPTH_TEST);
 }
 void draw_3_textures (Texture* t1, Texture* t2, Texture* t3, Program* p) {
-	GLint vertices[] = {
-		0, 0,
-		1, 0,
-		1, 1,
-		0, 1
-	};
-	GLint tex_coords[] = {
-		0, 0,
-		1, 0,
-		1, 1,
-		0, 1
-	};
-	
 	Projection::orthographic (0, 1, 0, 1, -1, 1);
 	
 	// enable stuff
 	if (p) p->use ();
-	glEnableClientState (GL_VERTEX_ARRAY);
-	glEnableClientState (GL_TEXTURE_COORD_ARRAY);
-	glVertexPointer (2, GL_INT, 0, vertices);
-	glTexCoordPointer (2, GL_INT, 0, tex_coords);
 	glDisable (GL_DEPTH_TEST);
 	
 	// bind textures
@@ -264,7 +612,7 @@ void draw_3_textures (Texture* t1, Texture* t2, Texture* t3, Program* p) {
 	p->set_uniform_int ("t3", 2);
 	
 	// draw
-	glDrawArrays (GL_QUADS, 0, 4);
+	draw_fullscreen ();
 	
 	// unbind textures
 //	glActiveTexture (GL_TEXTURE2);
@@ -275,32 +623,484 @@ void draw_3_textures (Texture* t1, Texture* t2, Texture* t3, Program* p) {
 	t1->unbind ();
 	
 	// disable stuff:
-	glDisableClientState (GL_VERTEX_ARRAY);
-	glDisableClientState (GL_TEXTURE_COORD_ARRAY);
 	glEnable (GL_DEPTH_TEST);
 }
 
+// TextureStreamer
+struct TextureLoad {
+	Texture* texture;
+	char* filename;
+	int width, height;
+	// the levels to load
+	int first_level, last_level;
+	unsigned char* data[32];
+};
+struct TextureStream {
+	char* filename;
+	int levels;
+	// the finest resident level and the finest level that is always resident
+	int resident_level;
+	int minimum_level;
+	int requested_level;
+	int last_used;
+	TextureLoad* load;
+	// after levels did not fit into the budget, no new load before
+	// retry_frame; the wait doubles with every failure in a row
+	int retry_frame;
+	int retry_wait;
+};
+int TextureStreamer::frame = 0;
+bool TextureStreamer::enabled = true;
+size_t TextureStreamer::budget = 0;
+int TextureStreamer::resident_size = 64;
+float TextureStreamer::screen_scale = 1000.0f;
+int TextureStreamer::streamed = 0;
+int TextureStreamer::evicted = 0;
+int TextureStreamer::budget_limited = 0;
+static List<Texture*> streamed_textures;
+static List<TextureLoad*> stream_queue;
+static List<TextureLoad*> stream_done;
+static pthread_mutex_t stream_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t stream_condition = PTHREAD_COND_INITIALIZER;
+static bool stream_thread_running = false;
+static bool stream_quit = false;
+static pthread_t stream_thread;
+
+static int get_level_size (int size, int level) {
+	size >>= level;
+	return size > 0 ? size : 1;
+}
+static size_t get_levels_size (int width, int height, int first_level, int last_level) {
+	size_t size = 0;
+	for (int i=first_level; i<=last_level; i++)
+		size += Texture::get_size (get_level_size(width,i), get_level_size(height,i), GL_RGBA8);
+	return size;
+}
+static unsigned char* decode_image (const char* filename, int* width, int* height) {
+	int channels;
+	unsigned char* image = SOIL_load_image (filename, width, height, &channels, SOIL_LOAD_RGBA);
+	if (!image)
+		return NULL;
+	// SOIL_FLAG_INVERT_Y
+	int row = *width * 4;
+	unsigned char* data = (unsigned char*) malloc (row * *height);
+	for (int y=0; y<*height; y++)
+		memcpy (data + y*row, image + (*height-1-y)*row, row);
+	SOIL_free_image_data (image);
+	return data;
+}
+// DecodedImages
+struct DecodedImage {
+	char* filename;
+	unsigned char* data;
+	int width, height;
+	DecodedImage* next;
+};
+DecodedImages::DecodedImages (): first(NULL) {
+	
+}
+DecodedImages::~DecodedImages () {
+	while (first) {
+		DecodedImage* image = first;
+		first = image->next;
+		free (image->filename);
+		free (image->data);
+		delete image;
+	}
+}
+bool DecodedImages::decode (const char* filename) {
+	int width, height;
+	unsigned char* data = decode_image (filename, &width, &height);
+	if (!data)
+		return false;
+	DecodedImage* image = new DecodedImage ();
+	image->filename = strdup (filename);
+	image->data = data;
+	image->width = width;
+	image->height = height;
+	image->next = first;
+	first = image;
+	return true;
+}
+unsigned char* DecodedImages::take (const char* filename, int* width, int* height) {
+	for (DecodedImage** link = &first; *link; link = &(*link)->next) {
+		DecodedImage* image = *link;
+		if (strcmp(image->filename, filename) != 0)
+			continue;
+		unsigned char* data = image->data;
+		*width = image->width;
+		*height = image->height;
+		*link = image->next;
+		free (image->filename);
+		delete image;
+		return data;
+	}
+	return NULL;
+}
+// RGBA, the first row at the bottom
+static unsigned char* load_image (const char* filename, DecodedImages* images, int* width, int* height) {
+	unsigned char* data = images ? images->take (filename, width, height) : NULL;
+	if (data)
+		return data;
+	return decode_image (filename, width, height);
+}
+// 2x2 box filter
+static unsigned char* downsample (const unsigned char* data, int width, int height) {
+	int w = get_level_size (width, 1);
+	int h = get_level_size (height, 1);
+	unsigned char* result = (unsigned char*) malloc (w*h*4);
+	for (int y=0; y<h; y++) {
+		int y0 = y*2 < height ? y*2 : height-1;
+		int y1 = y*2+1 < height ? y*2+1 : height-1;
+		for (int x=0; x<w; x++) {
+			int x0 = x*2 < width ? x*2 : width-1;
+			int x1 = x*2+1 < width ? x*2+1 : width-1;
+			for (int c=0; c<4; c++) {
+				int sum = data[(y0*width+x0)*4+c] + data[(y0*width+x1)*4+c] + data[(y1*width+x0)*4+c] + data[(y1*width+x1)*4+c];
+				result[(y*w+x)*4+c] = (sum + 2) / 4;
+			}
+		}
+	}
+	return result;
+}
+static void* stream_worker (void*) {
+	pthread_mutex_lock (&stream_mutex);
+	while (true) {
+		while (stream_queue.count() == 0 && !stream_quit)
+			pthread_cond_wait (&stream_condition, &stream_mutex);
+		if (stream_quit)
+			break;
+		TextureLoad* load = stream_queue[0];
+		stream_queue.remove (0);
+		pthread_mutex_unlock (&stream_mutex);
+		
+		// decode the file and filter it down to the requested levels
+		int width, height;
+		unsigned char* data = decode_image (load->filename, &width, &height);
+		if (data && (width != load->width || height != load->height)) {
+			free (data);
+			data = NULL;
+		}
+		for (int i=0; data && i<=load->last_level; i++) {
+			unsigned char* next = i < load->last_level ? downsample (data, get_level_size(width,i), get_level_size(height,i)) : NULL;
+			if (i >= load->first_level)
+				load->data[i] = data;
+			else
+				free (data);
+			data = next;
+		}
+		
+		pthread_mutex_lock (&stream_mutex);
+		stream_done.append (load);
+	}
+	pthread_mutex_unlock (&stream_mutex);
+	return NULL;
+}
+
+void Texture::load_streamed (const char* filename, DecodedImages* images) {
+	stream = new TextureStream ();
+	stream->filename = strdup (filename);
+	stream->levels = 0;
+	stream->resident_level = 0;
+	stream->minimum_level = 0;
+	stream->requested_level = 0;
+	stream->last_used = 0;
+	stream->load = NULL;
+	stream->retry_frame = 0;
+	stream->retry_wait = 0;
+	glGenTextures (1, &identifier);
+	unsigned char* data = load_image (filename, images, &width, &height);
+	if (!data) {
+		fprintf (stderr, "Texture::Texture(): failed to load %s: %s\n", filename, SOIL_last_result());
+		width = height = 0;
+		resource = ResourceManager::add (ResourceManager::TEXTURE, 0, filename);
+		return;
+	}
+	int size = width > height ? width : height;
+	stream->levels = 1;
+	while (size >> stream->levels)
+		stream->levels++;
+	while (stream->minimum_level < stream->levels-1 && (size >> stream->minimum_level) > TextureStreamer::resident_size)
+		stream->minimum_level++;
+	stream->resident_level = stream->minimum_level;
+	stream->requested_level = stream->minimum_level;
+	
+	// upload the low levels only
+	glBindTexture (GL_TEXTURE_2D, identifier);
+	for (int i=0; i<stream->levels; i++) {
+		int w = get_level_size (width, i);
+		int h = get_level_size (height, i);
+		if (i >= stream->minimum_level)
+			glTexImage2D (GL_TEXTURE_2D, i, GL_RGBA8, w, h, 0, GL_RGBA, GL_UNSIGNED_BYTE, data);
+		unsigned char* next = i < stream->levels-1 ? downsample (data, w, h) : NULL;
+		free (data);
+		data = next;
+	}
+	glTexParameteri (GL_TEXTURE_2D, GL_TEXTURE_BASE_LEVEL, stream->resident_level);
+	glTexParameteri (GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, stream->levels-1);
+	glTexParameteri (GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+	glTexParameteri (GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
+	glTexParameteri (GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
+	glTexParameteri (GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
+	glTexParameterf (GL_TEXTURE_2D, GL_TEXTURE_MAX_ANISOTROPY_EXT, 4.0f);
+	Error::label (GL_TEXTURE, identifier, filename);
+	glBindTexture (GL_TEXTURE_2D, 0);
+	resource = ResourceManager::add (ResourceManager::TEXTURE, get_levels_size(width, height, stream->resident_level, stream->levels-1), filename);
+	streamed_textures.append (this);
+}
+void Texture::unload_streamed () {
+	// a load that is still in flight is discarded by TextureStreamer::update
+	if (stream->load)
+		stream->load->texture = NULL;
+	for (int i=0; i<streamed_textures.count(); i++) {
+		if (streamed_textures[i] == this) {
+			streamed_textures.remove (i);
+			break;
+		}
+	}
+	free (stream->filename);
+	delete stream;
+	stream = NULL;
+}
+void Texture::request (float screen_size) {
+	if (!stream || stream->levels == 0)
+		return;
+	stream->last_used = TextureStreamer::frame;
+	// the coarsest level that still covers screen_size
+	int size = width > height ? width : height;
+	int level = 0;
+	while (level < stream->levels-1 && (size >> (level+1)) >= screen_size)
+		level++;
+	stream->requested_level = level;
+	if (level >= stream->resident_level || stream->load || TextureStreamer::frame < stream->retry_frame)
+		return;
+	TextureLoad* load = new TextureLoad ();
+	load->texture = this;
+	load->filename = strdup (stream->filename);
+	load->width = width;
+	load->height = height;
+	load->first_level = level;
+	load->last_level = stream->resident_level - 1;
+	memset (load->data, 0, sizeof(load->data));
+	stream->load = load;
+	pthread_mutex_lock (&stream_mutex);
+	if (!stream_thread_running) {
+		pthread_create (&stream_thread, NULL, stream_worker, NULL);
+		// runs before the static lists and the mutex are destroyed
+		static bool registered = false;
+		if (!registered)
+			atexit (TextureStreamer::shutdown);
+		registered = true;
+		stream_thread_running = true;
+	}
+	stream_queue.append (load);
+	pthread_cond_signal (&stream_condition);
+	pthread_mutex_unlock (&stream_mutex);
+}
+
+void TextureStreamer::shutdown () {
+	pthread_mutex_lock (&stream_mutex);
+	if (!stream_thread_running) {
+		pthread_mutex_unlock (&stream_mutex);
+		return;
+	}
+	stream_quit = true;
+	pthread_cond_signal (&stream_condition);
+	pthread_mutex_unlock (&stream_mutex);
+	pthread_join (stream_thread, NULL);
+	stream_thread_running = false;
+	stream_quit = false;
+}
+void TextureStreamer::evict (Texture* texture) {
+	TextureStream* stream = texture->stream;
+	glBindTexture (GL_TEXTURE_2D, texture->identifier);
+	glTexImage2D (GL_TEXTURE_2D, stream->resident_level, GL_RGBA8, 0, 0, 0, GL_RGBA, GL_UNSIGNED_BYTE, NULL);
+	stream->resident_level++;
+	glTexParameteri (GL_TEXTURE_2D, GL_TEXTURE_BASE_LEVEL, stream->resident_level);
+	glBindTexture (GL_TEXTURE_2D, 0);
+	ResourceManager::resize (texture->resource, get_levels_size(texture->width, texture->height, stream->resident_level, stream->levels-1));
+	evicted++;
+}
+bool TextureStreamer::make_room (size_t size, Texture* keep) {
+	if (budget == 0)
+		return true;
+	while (ResourceManager::get_total() + size > budget) {
+		// levels that are finer than requested or belong to textures that were not
+		// used during the last frame can go, least recently used first
+		Texture* lru = NULL;
+		for (int i=0; i<streamed_textures.count(); i++) {
+			Texture* texture = streamed_textures[i];
+			TextureStream* stream = texture->stream;
+			if (texture == keep || stream->resident_level >= stream->minimum_level)
+				continue;
+			if (stream->resident_level >= stream->requested_level && stream->last_used >= frame-1)
+				continue;
+			if (!lru || stream->last_used < lru->stream->last_used)
+				lru = texture;
+		}
+		if (!lru)
+			return false;
+		evict (lru);
+	}
+	return true;
+}
+void TextureStreamer::update () {
+	streamed = 0;
+	evicted = 0;
+	budget_limited = 0;
+	frame++;
+	
+	pthread_mutex_lock (&stream_mutex);
+	List<TextureLoad*> done = stream_done;
+	stream_done.clear ();
+	pthread_mutex_unlock (&stream_mutex);
+	
+	for (int i=0; i<done.count(); i++) {
+		TextureLoad* load = done[i];
+		Texture* texture = load->texture;
+		if (texture) {
+			TextureStream* stream = texture->stream;
+			stream->load = NULL;
+			// upload from coarse to fine, but only while the levels stay contiguous
+			if (load->last_level == stream->resident_level-1) {
+				for (int level=load->last_level; level>=load->first_level && load->data[level]; level--) {
+					int w = get_level_size (texture->width, level);
+					int h = get_level_size (texture->height, level);
+					if (!make_room (Texture::get_size(w, h, GL_RGBA8), texture)) {
+						// decoding the file again right away would not fit either
+						budget_limited++;
+						stream->retry_wait = stream->retry_wait > 0 ? stream->retry_wait * 2 : 16;
+						if (stream->retry_wait > 1024)
+							stream->retry_wait = 1024;
+						stream->retry_frame = frame + stream->retry_wait;
+						break;
+					}
+					glBindTexture (GL_TEXTURE_2D, texture->identifier);
+					glTexImage2D (GL_TEXTURE_2D, level, GL_RGBA8, w, h, 0, GL_RGBA, GL_UNSIGNED_BYTE, load->data[level]);
+					stream->resident_level = level;
+					glTexParameteri (GL_TEXTURE_2D, GL_TEXTURE_BASE_LEVEL, level);
+					glBindTexture (GL_TEXTURE_2D, 0);
+					ResourceManager::resize (texture->resource, get_levels_size(texture->width, texture->height, level, stream->levels-1));
+					streamed++;
+					if (level == load->first_level)
+						stream->retry_wait = 0;
+				}
+			}
+		}
+		for (int level=load->first_level; level<=load->last_level; level++)
+			free (load->data[level]);
+		free (load->filename);
+		delete load;
+	}
+	
+	// the budget might have been lowered or other resources might have grown
+	if (!make_room (0, NULL))
+		budget_limited++;
+}
+
 // Buffer
-Buffer::Buffer (int size) {
-	glGenBuffers (1, &identifier);
-	glBindBuffer (GL_ARRAY_BUFFER, identifier);
-	glBufferData (GL_ARRAY_BUFFER, size, NULL, GL_STATIC_DRAW);
-	glBindBuffer (GL_ARRAY_BUFFER, 0);
+Buffer::Buffer (int size, const char* tag): target(GL_ARRAY_BUFFER) {
+	if (Backend::type == Backend::CORE) {
+		glCreateBuffers (1, &identifier);
+		glNamedBufferData (identifier, size, NULL, GL_STATIC_DRAW);
+	}
+	else {
+		glGenBuffers (1, &identifier);
+		glBindBuffer (GL_ARRAY_BUFFER, identifier);
+		glBufferData (GL_ARRAY_BUFFER, size, NULL, GL_STATIC_DRAW);
+		glBindBuffer (GL_ARRAY_BUFFER, 0);
+	}
+	Error::label (GL_BUFFER, identifier, tag);
+	resource = ResourceManager::add (ResourceManager::BUFFER, size, tag);
+}
+Buffer::Buffer (int size, GLenum target, GLenum usage, const char* tag): target(target) {
+	if (Backend::type == Backend::CORE) {
+		glCreateBuffers (1, &identifier);
+		glNamedBufferData (identifier, size, NULL, usage);
+	}
+	else {
+		glGenBuffers (1, &identifier);
+		glBindBuffer (target, identifier);
+		glBufferData (target, size, NULL, usage);
+		glBindBuffer (target, 0);
+	}
+	Error::label (GL_BUFFER, identifier, tag);
+	resource = ResourceManager::add (ResourceManager::BUFFER, size, tag);
 }
 Buffer::~Buffer () {
+	ResourceManager::remove (resource);
 	glDeleteBuffers (1, &identifier);
 }
 void Buffer::bind () {
-	glBindBuffer (GL_ARRAY_BUFFER, identifier);
+	glBindBuffer (target, identifier);
+	if (Capture::active)
+		Capture::bind_buffer (target, identifier);
 }
 void Buffer::unbind () {
-	glBindBuffer (GL_ARRAY_BUFFER, 0);
+	glBindBuffer (target, 0);
+	if (Capture::active)
+		Capture::bind_buffer (target, 0);
 }
 void Buffer::set_data (int offset, int size, void* data) {
+	if (Backend::type == Backend::CORE) {
+		glNamedBufferSubData (identifier, offset, size, data);
+		return;
+	}
+	bind ();
+	glBufferSubData (target, offset, size, data);
+	if (Capture::active)
+		Capture::buffer_sub_data (target, offset, size, data);
+	unbind ();
+}
+void* Buffer::map (GLenum access) {
+	if (Backend::type == Backend::CORE)
+		return glMapNamedBuffer (identifier, access);
 	bind ();
-	glBufferSubData (GL_ARRAY_BUFFER, offset, size, data);
+	return glMapBuffer (target, access);
+}
+void Buffer::unmap () {
+	if (Backend::type == Backend::CORE) {
+		glUnmapNamedBuffer (identifier);
+		return;
+	}
+	glUnmapBuffer (target);
 	unbind ();
 }
+void Buffer::set_persistent () {
+	ResourceManager::set_persistent (resource);
+}
+
+// VertexArray
+VertexArray::VertexArray (const char* tag) {
+	glCreateVertexArrays (1, &identifier);
+	Error::label (GL_VERTEX_ARRAY, identifier, tag);
+	// only state, the data is in the buffers
+	resource = ResourceManager::add (ResourceManager::VERTEX_ARRAY, 0, tag);
+}
+VertexArray::~VertexArray () {
+	ResourceManager::remove (resource);
+	glDeleteVertexArrays (1, &identifier);
+}
+void VertexArray::set_persistent () {
+	ResourceManager::set_persistent (resource);
+}
+void VertexArray::set_attribute (GLuint index, Buffer* buffer, int offset, int stride, int size, GLenum type, int divisor) {
+	// every attribute has a binding point of its own
+	glVertexArrayVertexBuffer (identifier, index, buffer->identifier, offset, stride);
+	glVertexArrayAttribFormat (identifier, index, size, type, GL_FALSE, 0);
+	glVertexArrayAttribBinding (identifier, index, index);
+	glVertexArrayBindingDivisor (identifier, index, divisor);
+	glEnableVertexArrayAttrib (identifier, index);
+}
+void VertexArray::disable_attribute (GLuint index) {
+	glDisableVertexArrayAttrib (identifier, index);
+}
+void VertexArray::bind () {
+	glBindVertexArray (identifier);
+}
+void VertexArray::unbind () {
+	glBindVertexArray (0);
+}
 
 // FramebufferObject
 /*
@@ -339,29 +1139,71 @@ FramebufferObject::FramebufferObject (Texture* texture, Texture* depth) {
 	glBindFramebuffer (GL_FRAMEBUFFER, 0);
 }
 */
-FramebufferObject::FramebufferObject (int width, int height, GLenum texture_format): width(width), height(height), color_attachments_count(1) {
-	glGenFramebuffers (1, &identifier);
-	glBindFramebuffer (GL_FRAMEBUFFER, identifier);
-	color_texture = new Texture (width, height, texture_format);
-	glFramebufferTexture2D (GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, color_texture->identifier, 0);
-	depth_texture = new Texture (width, height, GL_DEPTH_COMPONENT);
-	glFramebufferTexture2D (GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_TEXTURE_2D, depth_texture->identifier, 0);
-	if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE)
+// the calls that differ between the backends, the legacy one edits the
+// framebuffer while it is bound
+static GLuint create_framebuffer () {
+	GLuint framebuffer;
+	if (Backend::type == Backend::CORE) {
+		glCreateFramebuffers (1, &framebuffer);
+	}
+	else {
+		glGenFramebuffers (1, &framebuffer);
+		glBindFramebuffer (GL_FRAMEBUFFER, framebuffer);
+	}
+	return framebuffer;
+}
+static void attach_framebuffer_texture (GLuint framebuffer, GLenum attachment, Texture* texture) {
+	if (Backend::type == Backend::CORE)
+		glNamedFramebufferTexture (framebuffer, attachment, texture->identifier, 0);
+	else if (texture->target == GL_TEXTURE_2D)
+		glFramebufferTexture2D (GL_FRAMEBUFFER, attachment, GL_TEXTURE_2D, texture->identifier, 0);
+	else
+		glFramebufferTexture (GL_FRAMEBUFFER, attachment, texture->identifier, 0);
+}
+static void complete_framebuffer (GLuint framebuffer) {
+	GLenum status = Backend::type == Backend::CORE ? glCheckNamedFramebufferStatus (framebuffer, GL_FRAMEBUFFER) : glCheckFramebufferStatus (GL_FRAMEBUFFER);
+	if (status != GL_FRAMEBUFFER_COMPLETE)
 		printf ("FramebufferObject::FramebufferObject: error\n");
-	glBindFramebuffer (GL_FRAMEBUFFER, 0);
+	Error::label (GL_FRAMEBUFFER, framebuffer, "FramebufferObject");
+	if (Backend::type == Backend::LEGACY)
+		glBindFramebuffer (GL_FRAMEBUFFER, 0);
+}
+FramebufferObject::FramebufferObject (int width, int height, GLenum texture_format): width(width), height(height), viewport_width(width), viewport_height(height), color_attachments_count(1) {
+	identifier = create_framebuffer ();
+	color_texture = new Texture (width, height, texture_format, "FramebufferObject color");
+	attach_framebuffer_texture (identifier, GL_COLOR_ATTACHMENT0, color_texture);
+	depth_texture = new Texture (width, height, GL_DEPTH_COMPONENT, "FramebufferObject depth");
+	attach_framebuffer_texture (identifier, GL_DEPTH_ATTACHMENT, depth_texture);
+	complete_framebuffer (identifier);
+	// the storage belongs to the textures, which are accounted for separately
+	resource = ResourceManager::add (ResourceManager::FRAMEBUFFER, 0, "FramebufferObject");
 }
 FramebufferObject::~FramebufferObject () {
+	ResourceManager::remove (resource);
 	glDeleteFramebuffers (1, &identifier);
+	// textures attached with attach_texture are owned by the caller
+	delete color_texture;
+	delete depth_texture;
+}
+FramebufferObject::FramebufferObject (int width, int height, GLenum texture_format, int layers): width(width), height(height), viewport_width(width), viewport_height(height), color_attachments_count(1) {
+	identifier = create_framebuffer ();
+	color_texture = new Texture (width, height, layers, texture_format, "FramebufferObject color");
+	attach_framebuffer_texture (identifier, GL_COLOR_ATTACHMENT0, color_texture);
+	depth_texture = new Texture (width, height, layers, GL_DEPTH_COMPONENT, "FramebufferObject depth");
+	attach_framebuffer_texture (identifier, GL_DEPTH_ATTACHMENT, depth_texture);
+	complete_framebuffer (identifier);
+	resource = ResourceManager::add (ResourceManager::FRAMEBUFFER, 0, "FramebufferObject");
 }
 void FramebufferObject::bind () {
 	glBindFramebuffer (GL_FRAMEBUFFER, identifier);
-	glViewport (0, 0, width, height);
+	glViewport (0, 0, viewport_width, viewport_height);
 	glClear (GL_COLOR_BUFFER_BIT|GL_DEPTH_BUFFER_BIT);
 //	glLoadIdentity ();
 //	printf ("FramebufferObject::bind: color_attachments_count == %d\n", color_attachments_count);
+	// the core backend sets the draw buffers in attach_texture
 	if (color_attachments_count > 4)
 		printf ("FramebufferObject::bind: more than 4 attachments are not yet supported\n");
-	else if (color_attachments_count > 1) {
+	else if (color_attachments_count > 1 && Backend::type == Backend::LEGACY) {
 		GLenum buffers[] = {GL_COLOR_ATTACHMENT0, GL_COLOR_ATTACHMENT1, GL_COLOR_ATTACHMENT2, GL_COLOR_ATTACHMENT3};
 		glDrawBuffers (color_attachments_count, buffers);
 	}
@@ -369,18 +1211,77 @@ void FramebufferObject::bind () {
 		GLenum buffers[] = {GL_BACK_BUFFER};
 		glDrawBuffers (1, buffers);
 	}*/
+	if (Capture::active)
+		Capture::bind_framebuffer (identifier, viewport_width, viewport_height, GL_COLOR_BUFFER_BIT|GL_DEPTH_BUFFER_BIT, color_attachments_count);
 }
 void FramebufferObject::unbind () {
 	glBindFramebuffer (GL_FRAMEBUFFER, 0);
+	if (Capture::active)
+		Capture::bind_framebuffer (0, 0, 0, 0, 0);
 }
 void FramebufferObject::attach_texture (Texture* texture) {
+	if (Backend::type == Backend::CORE) {
+		glNamedFramebufferTexture (identifier, GL_COLOR_ATTACHMENT0 + color_attachments_count++, texture->identifier, 0);
+		GLenum buffers[] = {GL_COLOR_ATTACHMENT0, GL_COLOR_ATTACHMENT1, GL_COLOR_ATTACHMENT2, GL_COLOR_ATTACHMENT3};
+		if (color_attachments_count <= 4)
+			glNamedFramebufferDrawBuffers (identifier, color_attachments_count, buffers);
+		return;
+	}
 	glBindFramebuffer (GL_FRAMEBUFFER, identifier);
 	glFramebufferTexture2D (GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0 + color_attachments_count++, GL_TEXTURE_2D, texture->identifier, 0);
 	glBindFramebuffer (GL_FRAMEBUFFER, 0);
 }
+void FramebufferObject::set_viewport (int width, int height) {
+	viewport_width = width < this->width ? width : this->width;
+	viewport_height = height < this->height ? height : this->height;
+	if (viewport_width < 1) viewport_width = 1;
+	if (viewport_height < 1) viewport_height = 1;
+}
 
 // Shader
-Shader::Shader (const char* filename, GLenum type) {
+// what the GLSL 1.10 shaders take from the fixed-function pipeline, declared
+// for the core profile in terms of the Backend attributes and the
+// FixedFunction uniforms
+static const char* core_vertex_prelude =
+	"#define attribute in\n"
+	"#define varying out\n"
+	"layout(location = 0) in vec4 core_vertex;\n"
+	"layout(location = 1) in vec3 core_normal;\n"
+	"layout(location = 2) in vec4 core_tex_coord;\n"
+	"uniform mat4 core_projection_matrix;\n"
+	"uniform mat4 core_modelview_matrix;\n"
+	"uniform mat3 core_normal_matrix;\n"
+	"uniform mat4 core_texture_matrix[1];\n"
+	"uniform vec4 core_color;\n"
+	"out vec4 core_front_color;\n"
+	"out vec4 core_tex_coords[1];\n"
+	"vec4 core_back_color;\n"
+	"invariant gl_Position;\n"
+	"#define gl_Vertex core_vertex\n"
+	"#define gl_Normal core_normal\n"
+	"#define gl_MultiTexCoord0 core_tex_coord\n"
+	"#define gl_Color core_color\n"
+	"#define gl_FrontColor core_front_color\n"
+	"#define gl_BackColor core_back_color\n"
+	"#define gl_TexCoord core_tex_coords\n"
+	"#define gl_ModelViewMatrix core_modelview_matrix\n"
+	"#define gl_ProjectionMatrix core_projection_matrix\n"
+	"#define gl_ModelViewProjectionMatrix (core_projection_matrix * core_modelview_matrix)\n"
+	"#define gl_NormalMatrix core_normal_matrix\n"
+	"#define gl_TextureMatrix core_texture_matrix\n"
+	"#define ftransform() (core_projection_matrix * core_modelview_matrix * core_vertex)\n";
+static const char* core_fragment_prelude =
+	"#define varying in\n"
+	"in vec4 core_front_color;\n"
+	"in vec4 core_tex_coords[1];\n"
+	"layout(location = 0) out vec4 core_frag_data[4];\n"
+	"vec4 core_texture2D (sampler2D s, vec2 p) { return texture (s, p); }\n"
+	"#define gl_Color core_front_color\n"
+	"#define gl_TexCoord core_tex_coords\n"
+	"#define gl_FragColor core_frag_data[0]\n"
+	"#define gl_FragData core_frag_data\n"
+	"#define texture2D core_texture2D\n";
+Shader::Shader (const char* filename, GLenum type, const char* defines): resource(-1), identifier(0) {
 	FILE* file = fopen (filename, "r");
 	if (!file) {
 		fprintf (stderr, "Shader::Shader(): could not find the file %s\n", filename);
@@ -396,7 +1297,30 @@ Shader::Shader (const char* filename, GLenum type) {
 	fclose (file);
 	
 	identifier = glCreateShader (type);
-	glShaderSource (identifier, 1, &source, &length);
+	Error::label (GL_SHADER, identifier, filename);
+	// the defines have to follow the #version and #extension directives
+	int version_length = 0;
+	if (length > 8 && strncmp (source, "#version", 8) == 0) {
+		while (version_length < length && source[version_length] != '\n')
+			version_length++;
+		if (version_length < length)
+			version_length++;
+	}
+	int header_length = version_length;
+	while (length - header_length > 10 && strncmp (source + header_length, "#extension", 10) == 0) {
+		while (header_length < length && source[header_length] != '\n')
+			header_length++;
+		if (header_length < length)
+			header_length++;
+	}
+	// the core backend replaces the version and declares the fixed-function inputs
+	bool core = Backend::type == Backend::CORE;
+	const char* prelude = "";
+	if (core)
+		prelude = type == GL_VERTEX_SHADER ? core_vertex_prelude : core_fragment_prelude;
+	const GLchar* sources[] = {core ? "#version 450 core\n" : source, source + version_length, defines ? defines : "", prelude, source + header_length};
+	GLint lengths[] = {core ? -1 : version_length, header_length - version_length, -1, -1, length - header_length};
+	glShaderSource (identifier, 5, sources, lengths);
 	glCompileShader (identifier);
 	
 	GLint compile_status;
@@ -411,75 +1335,825 @@ Shader::Shader (const char* filename, GLenum type) {
 	}
 	
 	free (source);
+	// the compiled size is not known, the source length is a rough estimate
+	resource = ResourceManager::add (ResourceManager::SHADER, length, filename);
 }
 Shader::~Shader () {
+	ResourceManager::remove (resource);
 	glDeleteShader (identifier);
 }
 
 // Program
-Program::Program (Shader* vertex_shader, Shader* fragment_shader) {
+static size_t get_program_size (GLuint program) {
+	GLint size = 0;
+	glGetProgramiv (program, GL_PROGRAM_BINARY_LENGTH, &size);
+	return size;
+}
+Program* Program::current = NULL;
+Program::Program (Shader* vertex_shader, Shader* fragment_shader): fixed_function_located(false), fixed_function_version(-1) {
 	identifier = glCreateProgram ();
 	glAttachShader (identifier, vertex_shader->identifier);
 	glAttachShader (identifier, fragment_shader->identifier);
-	glLinkProgram (identifier);
+	link_program ();
 	// add error handling here
+	Error::label (GL_PROGRAM, identifier, "Program");
+	resource = ResourceManager::add (ResourceManager::PROGRAM, get_program_size(identifier), "Program");
 }
-Program::Program (const char* vertex_shader, const char* fragment_shader) {
+Program::Program (const char* vertex_shader, const char* fragment_shader, const char* defines): fixed_function_located(false), fixed_function_version(-1) {
 	identifier = glCreateProgram ();
-	Shader* v = new Shader (vertex_shader, GL_VERTEX_SHADER);
-	Shader* f = new Shader (fragment_shader, GL_FRAGMENT_SHADER);
+	Shader* v = new Shader (vertex_shader, GL_VERTEX_SHADER, defines);
+	Shader* f = new Shader (fragment_shader, GL_FRAGMENT_SHADER, defines);
 	glAttachShader (identifier, v->identifier);
 	glAttachShader (identifier, f->identifier);
-	glLinkProgram (identifier);
+	link_program ();
 	// add error handling here
+	// the shaders are only flagged for deletion while they are attached
+	delete v;
+	delete f;
+	Error::label (GL_PROGRAM, identifier, fragment_shader);
+	resource = ResourceManager::add (ResourceManager::PROGRAM, get_program_size(identifier), fragment_shader);
 }
-Program::Program () {
+Program::Program (): fixed_function_located(false), fixed_function_version(-1) {
 	identifier = glCreateProgram ();
+	resource = ResourceManager::add (ResourceManager::PROGRAM, 0, "Program");
 }
 Program::~Program () {
+	if (current == this)
+		current = NULL;
+	ResourceManager::remove (resource);
 	glDeleteProgram (identifier);
 }
 void Program::attach_shader (Shader* shader) {
 	glAttachShader (identifier, shader->identifier);
 }
-void Program::link () {
+// the core backend has no built-in attributes, those of vertex_shader.glsl
+// get the locations the meshes set up their vertex arrays with
+void Program::link_program () {
+	if (Backend::type == Backend::CORE) {
+		const char* names[] = {"in_instance_0", "in_instance_1", "in_instance_2", "in_instance_3"};
+		glBindAttribLocation (identifier, Backend::TANGENT, "in_tangent");
+		for (int i=0; i<4; i++)
+			glBindAttribLocation (identifier, Backend::INSTANCE + i, names[i]);
+	}
 	glLinkProgram (identifier);
+	fixed_function_located = false;
+	fixed_function_version = -1;
+}
+void Program::link () {
+	link_program ();
 	// add error handling here
+	ResourceManager::resize (resource, get_program_size(identifier));
 }
 void Program::use () {
 	glUseProgram (identifier);
+	current = this;
+	if (Capture::active)
+		Capture::use_program (identifier);
 }
 void Program::set_uniform_int (const char* name, int value) {
 	GLint location = glGetUniformLocation (identifier, name);
-	glUniform1i (location, value);
+	if (Backend::type == Backend::CORE)
+		glProgramUniform1i (identifier, location, value);
+	else
+		glUniform1i (location, value);
+	if (Capture::active)
+		Capture::uniform (identifier, name, GL_INT, 1, &value);
+}
+void Program::set_uniform_float (const char* name, float value) {
+	GLint location = glGetUniformLocation (identifier, name);
+	if (Backend::type == Backend::CORE)
+		glProgramUniform1f (identifier, location, value);
+	else
+		glUniform1f (location, value);
+	if (Capture::active)
+		Capture::uniform (identifier, name, GL_FLOAT, 1, &value);
 }
 void Program::set_uniform_vec3 (const char* name, const vec3& value) {
 	GLint location = glGetUniformLocation (identifier, name);
-	glUniform3f (location, value.x, value.y, value.z);
+	if (Backend::type == Backend::CORE)
+		glProgramUniform3f (identifier, location, value.x, value.y, value.z);
+	else
+		glUniform3f (location, value.x, value.y, value.z);
+	if (Capture::active)
+		Capture::uniform (identifier, name, GL_FLOAT_VEC3, 1, &value);
+}
+void Program::set_uniform_mat4 (const char* name, const mat4* values, int count) {
+	GLint location = glGetUniformLocation (identifier, name);
+	if (Backend::type == Backend::CORE)
+		glProgramUniformMatrix4fv (identifier, location, count, GL_FALSE, values[0].m);
+	else
+		glUniformMatrix4fv (location, count, GL_FALSE, values[0].m);
+	if (Capture::active)
+		Capture::uniform (identifier, name, GL_FLOAT_MAT4, count, values[0].m);
 }
 int Program::get_attribute_location (const char* name) {
 	return glGetAttribLocation (identifier, name);
 }
+void Program::set_persistent () {
+	ResourceManager::set_persistent (resource);
+}
+
+// ProgramCache
+struct ProgramVariant {
+	const char* vertex_shader;
+	const char* fragment_shader;
+	int features;
+	Program* program;
+};
+static List<ProgramVariant> program_variants;
+int ProgramCache::generation = 0;
+Program* ProgramCache::get (const char* vertex_shader, const char* fragment_shader, int features, const char* const* feature_names) {
+	for (int i=0; i<program_variants.count(); i++) {
+		ProgramVariant& v = program_variants[i];
+		if (v.features == features && strcmp(v.vertex_shader, vertex_shader) == 0 && strcmp(v.fragment_shader, fragment_shader) == 0)
+			return v.program;
+	}
+	char defines[512] = "";
+	for (int i=0; features>>i; i++) {
+		if (features & (1<<i)) {
+			strcat (defines, "#define ");
+			strcat (defines, feature_names[i]);
+			strcat (defines, "\n");
+		}
+	}
+	ProgramVariant v;
+	v.vertex_shader = strdup (vertex_shader);
+	v.fragment_shader = strdup (fragment_shader);
+	v.features = features;
+	v.program = new Program (vertex_shader, fragment_shader, defines);
+	v.program->set_persistent ();
+	program_variants.append (v);
+	return v.program;
+}
+int ProgramCache::get_count () {
+	return program_variants.count ();
+}
+void ProgramCache::clear () {
+	for (int i=0; i<program_variants.count(); i++) {
+		free ((void*)program_variants[i].vertex_shader);
+		free ((void*)program_variants[i].fragment_shader);
+		delete program_variants[i].program;
+	}
+	program_variants.clear ();
+	generation++;
+}
 
 // Error
-void Error::print (const char* origin) {
-	GLenum error = glGetError ();
-	if (error == GL_NO_ERROR)
+#ifndef NDEBUG
+struct ErrorMessage {
+	GLenum source, type, severity;
+	GLuint id;
+	// of the text, which names the labeled object the message is about
+	unsigned int hash;
+	int count;
+};
+int Error::max_messages_per_second = 20;
+static List<ErrorMessage> error_messages;
+static pthread_mutex_t error_mutex = PTHREAD_MUTEX_INITIALIZER;
+static bool error_labels = false;
+static time_t error_second = 0;
+static int error_messages_this_second = 0;
+static int error_messages_suppressed = 0;
+static const char* get_debug_source (GLenum source) {
+	switch (source) {
+		case GL_DEBUG_SOURCE_API: return "API";
+		case GL_DEBUG_SOURCE_WINDOW_SYSTEM: return "window system";
+		case GL_DEBUG_SOURCE_SHADER_COMPILER: return "shader compiler";
+		case GL_DEBUG_SOURCE_THIRD_PARTY: return "third party";
+		case GL_DEBUG_SOURCE_APPLICATION: return "application";
+		default: return "other";
+	}
+}
+static const char* get_debug_type (GLenum type) {
+	switch (type) {
+		case GL_DEBUG_TYPE_ERROR: return "error";
+		case GL_DEBUG_TYPE_DEPRECATED_BEHAVIOR: return "deprecated behavior";
+		case GL_DEBUG_TYPE_UNDEFINED_BEHAVIOR: return "undefined behavior";
+		case GL_DEBUG_TYPE_PORTABILITY: return "portability";
+		case GL_DEBUG_TYPE_PERFORMANCE: return "performance";
+		default: return "other";
+	}
+}
+static const char* get_debug_severity (GLenum severity) {
+	switch (severity) {
+		case GL_DEBUG_SEVERITY_HIGH: return "high";
+		case GL_DEBUG_SEVERITY_MEDIUM: return "medium";
+		case GL_DEBUG_SEVERITY_LOW: return "low";
+		default: return "notification";
+	}
+}
+// FNV-1a
+static unsigned int get_message_hash (const GLchar* message, GLsizei length) {
+	if (length < 0)
+		length = strlen (message);
+	unsigned int hash = 2166136261u;
+	for (int i=0; i<length; i++)
+		hash = (hash ^ (unsigned char)message[i]) * 16777619u;
+	return hash;
+}
+// called with error_mutex locked
+static void print_suppressed_messages () {
+	if (error_messages_suppressed)
+		fprintf (stderr, "GL: %d messages suppressed\n", error_messages_suppressed);
+	error_messages_suppressed = 0;
+}
+// may be called from a driver thread
+static void APIENTRY debug_callback (GLenum source, GLenum type, GLuint id, GLenum severity, GLsizei length, const GLchar* message, const void* user) {
+	unsigned int hash = get_message_hash (message, length);
+	pthread_mutex_lock (&error_mutex);
+	// deduplicate
+	for (int i=0; i<error_messages.count(); i++) {
+		ErrorMessage& m = error_messages[i];
+		if (m.source == source && m.type == type && m.id == id && m.severity == severity && m.hash == hash) {
+			m.count++;
+			pthread_mutex_unlock (&error_mutex);
+			return;
+		}
+	}
+	ErrorMessage m = {source, type, severity, id, hash, 1};
+	error_messages.append (m);
+	// rate limit
+	time_t now = time (NULL);
+	if (now != error_second) {
+		print_suppressed_messages ();
+		error_second = now;
+		error_messages_this_second = 0;
+	}
+	if (error_messages_this_second < Error::max_messages_per_second) {
+		fprintf (stderr, "GL %s %s (%s, %u): %s\n", get_debug_source(source), get_debug_type(type), get_debug_severity(severity), id, message);
+		error_messages_this_second++;
+	}
+	else {
+		error_messages_suppressed++;
+	}
+	pthread_mutex_unlock (&error_mutex);
+}
+static void print_repeated_messages () {
+	pthread_mutex_lock (&error_mutex);
+	print_suppressed_messages ();
+	for (int i=0; i<error_messages.count(); i++) {
+		ErrorMessage& m = error_messages[i];
+		if (m.count > 1)
+			fprintf (stderr, "GL %s %s (%s, %u) repeated %d times\n", get_debug_source(m.source), get_debug_type(m.type), get_debug_severity(m.severity), m.id, m.count);
+	}
+	pthread_mutex_unlock (&error_mutex);
+}
+void Error::enable (GLenum min_severity) {
+	// the core profile has no extension string, but KHR_debug is part of GL 4.3
+	const char* extensions = Backend::type == Backend::CORE ? "GL_KHR_debug" : (const char*) glGetString (GL_EXTENSIONS);
+	if (!extensions) {
+		fprintf (stderr, "Error::enable: no current context\n");
+		return;
+	}
+	// a burst from a previous context would otherwise only be reported with the next message
+	pthread_mutex_lock (&error_mutex);
+	print_suppressed_messages ();
+	pthread_mutex_unlock (&error_mutex);
+	// the messages are always asynchronous, GL_DEBUG_OUTPUT_SYNCHRONOUS would stall
+	if (strstr(extensions, "GL_KHR_debug")) {
+		glEnable (GL_DEBUG_OUTPUT);
+		glDebugMessageCallback (debug_callback, NULL);
+		error_labels = true;
+	}
+	else if (strstr(extensions, "GL_ARB_debug_output")) {
+		glDebugMessageCallbackARB (debug_callback, NULL);
+	}
+	else {
+		fprintf (stderr, "Error::enable: neither KHR_debug nor ARB_debug_output is supported\n");
 		return;
-	else if (error == GL_INVALID_ENUM)
-		fprintf (stderr, "%s GL_INVALID_ENUM\n", origin);
-	else if (error == GL_INVALID_VALUE)
-		fprintf (stderr, "%s GL_INVALID_VALUE\n", origin);
-	else if (error == GL_INVALID_OPERATION)
-		fprintf (stderr, "%s GL_INVALID_OPERATION\n", origin);
-	else if (error == GL_INVALID_FRAMEBUFFER_OPERATION)
-		fprintf (stderr, "%s GL_INVALID_FRAMEBUFFER_OPERATION\n", origin);
-	else if (error == GL_OUT_OF_MEMORY)
-		fprintf (stderr, "%s GL_OUT_OF_MEMORY\n", origin);
-	else if (error == GL_STACK_UNDERFLOW)
-		fprintf (stderr, "%s GL_STACK_UNDERFLOW\n", origin);
-	else if (error == GL_STACK_OVERFLOW)
-		fprintf (stderr, "%s GL_STACK_OVERFLOW\n", origin);
+	}
+	// severity filtering (ARB_debug_output has no notifications)
+	GLenum severities[] = {GL_DEBUG_SEVERITY_HIGH, GL_DEBUG_SEVERITY_MEDIUM, GL_DEBUG_SEVERITY_LOW, GL_DEBUG_SEVERITY_NOTIFICATION};
+	GLboolean enabled = GL_TRUE;
+	for (int i=0; i<4; i++) {
+		if (error_labels)
+			glDebugMessageControl (GL_DONT_CARE, GL_DONT_CARE, severities[i], 0, NULL, enabled);
+		else if (i < 3)
+			glDebugMessageControlARB (GL_DONT_CARE, GL_DONT_CARE, severities[i], 0, NULL, enabled);
+		if (severities[i] == min_severity)
+			enabled = GL_FALSE;
+	}
+	static bool registered = false;
+	if (!registered)
+		atexit (print_repeated_messages);
+	registered = true;
+}
+void Error::label (GLenum type, GLuint identifier, const char* name) {
+	if (error_labels && name)
+		glObjectLabel (type, identifier, -1, name);
+}
+#endif
+
+// Capture
+bool Capture::active = false;
+static FILE* capture_file = NULL;
+// the record being written, its size is only known at the end
+static unsigned char* record_data = NULL;
+static size_t record_size = 0;
+static size_t record_capacity = 0;
+static List<GLuint> captured_textures;
+static List<GLuint> captured_buffers;
+static List<GLuint> captured_programs;
+static List<GLuint> captured_framebuffers;
+
+static void put (const void* data, size_t size) {
+	if (record_size + size > record_capacity) {
+		record_capacity = (record_size + size) * 2;
+		record_data = (unsigned char*) realloc (record_data, record_capacity);
+	}
+	memcpy (record_data + record_size, data, size);
+	record_size += size;
+}
+static void put_int (int value) {
+	put (&value, 4);
+}
+static void put_string (const char* string) {
+	int length = strlen (string);
+	put_int (length);
+	put (string, length);
+}
+static void begin_record () {
+	record_size = 0;
+}
+static void end_record (Capture::Call call) {
+	unsigned int header[] = {call, (unsigned int)record_size};
+	fwrite (header, 4, 2, capture_file);
+	fwrite (record_data, 1, record_size, capture_file);
+}
+static bool is_captured (List<GLuint>& captured, GLuint identifier) {
+	for (int i=0; i<captured.count(); i++)
+		if (captured[i] == identifier)
+			return true;
+	captured.append (identifier);
+	return false;
+}
+static int get_type_size (GLenum type) {
+	switch (type) {
+		case GL_BYTE: case GL_UNSIGNED_BYTE: return 1;
+		case GL_SHORT: case GL_UNSIGNED_SHORT: case GL_HALF_FLOAT: return 2;
+		case GL_DOUBLE: return 8;
+		default: return 4;
+	}
+}
+static bool is_depth_format (GLint format) {
+	return format == GL_DEPTH_COMPONENT || format == GL_DEPTH_COMPONENT16 || format == GL_DEPTH_COMPONENT24 || format == GL_DEPTH_COMPONENT32 || format == GL_DEPTH_COMPONENT32F;
+}
+static bool is_float_format (GLint format) {
+	return format == GL_RGBA32F || format == GL_RGB32F || format == GL_RGBA16F || format == GL_RGB16F || format == GL_R32F || format == GL_RG32F;
+}
+
+// the contents of a texture as they are at the first use in the frame
+static void capture_texture (GLenum target, GLuint texture) {
+	if (texture == 0 || is_captured(captured_textures, texture))
+		return;
+	GLint active_texture, previous, pack_buffer;
+	glGetIntegerv (GL_ACTIVE_TEXTURE, &active_texture);
+	glActiveTexture (GL_TEXTURE0);
+	glGetIntegerv (target == GL_TEXTURE_2D_ARRAY ? GL_TEXTURE_BINDING_2D_ARRAY : GL_TEXTURE_BINDING_2D, &previous);
+	glGetIntegerv (GL_PIXEL_PACK_BUFFER_BINDING, &pack_buffer);
+	glBindBuffer (GL_PIXEL_PACK_BUFFER, 0);
+	glBindTexture (target, texture);
+	
+	begin_record ();
+	put_int (texture);
+	put_int (target);
+	GLint format = GL_RGBA8;
+	glGetTexLevelParameteriv (target, 0, GL_TEXTURE_INTERNAL_FORMAT, &format);
+	const GLenum parameters[] = {GL_TEXTURE_MIN_FILTER, GL_TEXTURE_MAG_FILTER, GL_TEXTURE_WRAP_S, GL_TEXTURE_WRAP_T, GL_TEXTURE_BASE_LEVEL, GL_TEXTURE_MAX_LEVEL};
+	for (int i=0; i<6; i++) {
+		GLint value;
+		glGetTexParameteriv (target, parameters[i], &value);
+		put_int (value);
+	}
+	// streamed textures have no levels below their base level
+	int levels[16];
+	int level_count = 0;
+	for (int level=0; level<16; level++) {
+		GLint width = 0;
+		glGetTexLevelParameteriv (target, level, GL_TEXTURE_WIDTH, &width);
+		if (width > 0)
+			levels[level_count++] = level;
+	}
+	put_int (level_count);
+	for (int i=0; i<level_count; i++) {
+		GLint width, height, depth = 1, level_format;
+		glGetTexLevelParameteriv (target, levels[i], GL_TEXTURE_WIDTH, &width);
+		glGetTexLevelParameteriv (target, levels[i], GL_TEXTURE_HEIGHT, &height);
+		if (target == GL_TEXTURE_2D_ARRAY)
+			glGetTexLevelParameteriv (target, levels[i], GL_TEXTURE_DEPTH, &depth);
+		glGetTexLevelParameteriv (target, levels[i], GL_TEXTURE_INTERNAL_FORMAT, &level_format);
+		GLenum pixel_format = is_depth_format(level_format) ? GL_DEPTH_COMPONENT : GL_RGBA;
+		GLenum type = is_depth_format(level_format) || is_float_format(level_format) ? GL_FLOAT : GL_UNSIGNED_BYTE;
+		int size = width * height * depth * (pixel_format == GL_RGBA ? 4 : 1) * get_type_size (type);
+		void* pixels = malloc (size);
+		glGetTexImage (target, levels[i], pixel_format, type, pixels);
+		put_int (levels[i]);
+		put_int (level_format);
+		put_int (width);
+		put_int (height);
+		put_int (depth);
+		put_int (pixel_format);
+		put_int (type);
+		put_int (size);
+		put (pixels, size);
+		free (pixels);
+	}
+	end_record (Capture::DEFINE_TEXTURE);
+	
+	glBindTexture (target, previous);
+	glBindBuffer (GL_PIXEL_PACK_BUFFER, pack_buffer);
+	glActiveTexture (active_texture);
+}
+static void capture_buffer (GLuint buffer) {
+	if (buffer == 0 || is_captured(captured_buffers, buffer))
+		return;
+	glBindBuffer (GL_COPY_READ_BUFFER, buffer);
+	GLint size = 0;
+	glGetBufferParameteriv (GL_COPY_READ_BUFFER, GL_BUFFER_SIZE, &size);
+	void* data = malloc (size);
+	glGetBufferSubData (GL_COPY_READ_BUFFER, 0, size, data);
+	glBindBuffer (GL_COPY_READ_BUFFER, 0);
+	begin_record ();
+	put_int (buffer);
+	put_int (size);
+	put (data, size);
+	end_record (Capture::DEFINE_BUFFER);
+	free (data);
+}
+static int get_uniform_components (GLenum type) {
+	switch (type) {
+		case GL_FLOAT_VEC2: case GL_INT_VEC2: return 2;
+		case GL_FLOAT_VEC3: case GL_INT_VEC3: return 3;
+		case GL_FLOAT_VEC4: case GL_INT_VEC4: return 4;
+		case GL_FLOAT_MAT3: return 9;
+		case GL_FLOAT_MAT4: return 16;
+		default: return 1;
+	}
+}
+static bool is_float_uniform (GLenum type) {
+	return type == GL_FLOAT || type == GL_FLOAT_VEC2 || type == GL_FLOAT_VEC3 || type == GL_FLOAT_VEC4 || type == GL_FLOAT_MAT3 || type == GL_FLOAT_MAT4;
+}
+// the sources, attribute locations and current uniform values
+static void capture_program (GLuint program) {
+	if (program == 0 || is_captured(captured_programs, program))
+		return;
+	begin_record ();
+	put_int (program);
+	// the shaders stay attached after they are deleted, so their sources are still available
+	GLuint shaders[8];
+	GLsizei shader_count = 0;
+	glGetAttachedShaders (program, 8, &shader_count, shaders);
+	put_int (shader_count);
+	for (int i=0; i<shader_count; i++) {
+		GLint type, length;
+		glGetShaderiv (shaders[i], GL_SHADER_TYPE, &type);
+		glGetShaderiv (shaders[i], GL_SHADER_SOURCE_LENGTH, &length);
+		char* source = (char*) malloc (length + 1);
+		glGetShaderSource (shaders[i], length + 1, NULL, source);
+		put_int (type);
+		put_string (source);
+		free (source);
+	}
+	char name[256];
+	GLint count = 0;
+	glGetProgramiv (program, GL_ACTIVE_ATTRIBUTES, &count);
+	List<int> locations;
+	List<char*> names;
+	for (int i=0; i<count; i++) {
+		GLint size;
+		GLenum type;
+		glGetActiveAttrib (program, i, sizeof(name), NULL, &size, &type, name);
+		int location = glGetAttribLocation (program, name);
+		if (location >= 0) {
+			locations.append (location);
+			names.append (strdup(name));
+		}
+	}
+	put_int (locations.count());
+	for (int i=0; i<locations.count(); i++) {
+		put_int (locations[i]);
+		put_string (names[i]);
+		free (names[i]);
+	}
+	// one entry per array element
+	glGetProgramiv (program, GL_ACTIVE_UNIFORMS, &count);
+	size_t count_offset = record_size;
+	int uniform_count = 0;
+	put_int (0);
+	for (int i=0; i<count; i++) {
+		GLint size;
+		GLenum type;
+		glGetActiveUniform (program, i, sizeof(name), NULL, &size, &type, name);
+		if (strncmp(name, "gl_", 3) == 0)
+			continue;
+		char* bracket = strchr (name, '[');
+		if (bracket) *bracket = '\0';
+		for (int element=0; element<size; element++) {
+			char element_name[300];
+			if (size > 1 || bracket)
+				snprintf (element_name, sizeof(element_name), "%s[%d]", name, element);
+			else
+				snprintf (element_name, sizeof(element_name), "%s", name);
+			GLint location = glGetUniformLocation (program, element_name);
+			if (location < 0)
+				continue;
+			GLfloat values[16];
+			if (is_float_uniform(type))
+				glGetUniformfv (program, location, values);
+			else
+				glGetUniformiv (program, location, (GLint*)values);
+			put_string (element_name);
+			put_int (type);
+			put (values, get_uniform_components(type) * 4);
+			uniform_count++;
+		}
+	}
+	memcpy (record_data + count_offset, &uniform_count, 4);
+	end_record (Capture::DEFINE_PROGRAM);
+}
+static void capture_framebuffer (GLuint framebuffer) {
+	if (framebuffer == 0 || is_captured(captured_framebuffers, framebuffer))
+		return;
+	GLint previous;
+	glGetIntegerv (GL_READ_FRAMEBUFFER_BINDING, &previous);
+	glBindFramebuffer (GL_READ_FRAMEBUFFER, framebuffer);
+	const GLenum attachments[] = {GL_COLOR_ATTACHMENT0, GL_COLOR_ATTACHMENT1, GL_COLOR_ATTACHMENT2, GL_COLOR_ATTACHMENT3, GL_DEPTH_ATTACHMENT};
+	GLint types[5], names[5], layered[5];
+	for (int i=0; i<5; i++) {
+		types[i] = GL_NONE;
+		names[i] = 0;
+		layered[i] = GL_FALSE;
+		glGetFramebufferAttachmentParameteriv (GL_READ_FRAMEBUFFER, attachments[i], GL_FRAMEBUFFER_ATTACHMENT_OBJECT_TYPE, &types[i]);
+		if (types[i] == GL_NONE)
+			continue;
+		glGetFramebufferAttachmentParameteriv (GL_READ_FRAMEBUFFER, attachments[i], GL_FRAMEBUFFER_ATTACHMENT_OBJECT_NAME, &names[i]);
+		if (types[i] == GL_TEXTURE)
+			glGetFramebufferAttachmentParameteriv (GL_READ_FRAMEBUFFER, attachments[i], GL_FRAMEBUFFER_ATTACHMENT_LAYERED, &layered[i]);
+	}
+	glBindFramebuffer (GL_READ_FRAMEBUFFER, previous);
+	for (int i=0; i<5; i++) {
+		if (types[i] == GL_TEXTURE)
+			capture_texture (layered[i] ? GL_TEXTURE_2D_ARRAY : GL_TEXTURE_2D, names[i]);
+	}
+	
+	begin_record ();
+	put_int (framebuffer);
+	int attachment_count = 0;
+	for (int i=0; i<5; i++)
+		if (types[i] != GL_NONE) attachment_count++;
+	put_int (attachment_count);
+	for (int i=0; i<5; i++) {
+		if (types[i] == GL_NONE)
+			continue;
+		put_int (attachments[i]);
+		put_int (types[i]);
+		put_int (names[i]);
+		put_int (layered[i]);
+		// renderbuffers are recreated from their size and format
+		GLint width = 0, height = 0, format = 0;
+		if (types[i] == GL_RENDERBUFFER) {
+			glBindRenderbuffer (GL_RENDERBUFFER, names[i]);
+			glGetRenderbufferParameteriv (GL_RENDERBUFFER, GL_RENDERBUFFER_WIDTH, &width);
+			glGetRenderbufferParameteriv (GL_RENDERBUFFER, GL_RENDERBUFFER_HEIGHT, &height);
+			glGetRenderbufferParameteriv (GL_RENDERBUFFER, GL_RENDERBUFFER_INTERNAL_FORMAT, &format);
+			glBindRenderbuffer (GL_RENDERBUFFER, 0);
+		}
+		put_int (width);
+		put_int (height);
+		put_int (format);
+	}
+	end_record (Capture::DEFINE_FRAMEBUFFER);
+}
+
+bool Capture::start (const char* filename) {
+	// the draw snapshots query the fixed-function state
+	if (Backend::type == Backend::CORE) {
+		fprintf (stderr, "Capture::start: only the legacy backend can be captured\n");
+		return false;
+	}
+	capture_file = fopen (filename, "wb");
+	if (!capture_file) {
+		fprintf (stderr, "Capture::start: failed to open %s\n", filename);
+		return false;
+	}
+	fwrite ("GLTRACE1", 1, 8, capture_file);
+	captured_textures.clear ();
+	captured_buffers.clear ();
+	captured_programs.clear ();
+	captured_framebuffers.clear ();
+	active = true;
+	
+	// the framebuffer and viewport the frame starts with
+	GLint framebuffer, viewport[4];
+	glGetIntegerv (GL_DRAW_FRAMEBUFFER_BINDING, &framebuffer);
+	glGetIntegerv (GL_VIEWPORT, viewport);
+	capture_framebuffer (framebuffer);
+	begin_record ();
+	put_int (framebuffer);
+	put (viewport, sizeof(viewport));
+	end_record (BEGIN);
+	return true;
+}
+void Capture::stop () {
+	if (!active)
+		return;
+	begin_record ();
+	end_record (END);
+	fclose (capture_file);
+	capture_file = NULL;
+	active = false;
+	printf ("Capture::stop: %d textures, %d buffers, %d programs, %d framebuffers\n", captured_textures.count(), captured_buffers.count(), captured_programs.count(), captured_framebuffers.count());
+}
+void Capture::bind_texture (int unit, GLenum target, GLuint texture) {
+	capture_texture (target, texture);
+	begin_record ();
+	put_int (unit);
+	put_int (target);
+	put_int (texture);
+	end_record (BIND_TEXTURE);
+}
+void Capture::bind_buffer (GLenum target, GLuint buffer) {
+	capture_buffer (buffer);
+	begin_record ();
+	put_int (target);
+	put_int (buffer);
+	end_record (BIND_BUFFER);
+}
+void Capture::buffer_sub_data (GLenum target, int offset, int size, const void* data) {
+	begin_record ();
+	put_int (target);
+	put_int (offset);
+	put_int (size);
+	put (data, size);
+	end_record (BUFFER_SUB_DATA);
+}
+void Capture::bind_framebuffer (GLuint framebuffer, int width, int height, GLbitfield clear_mask, int draw_buffers) {
+	capture_framebuffer (framebuffer);
+	begin_record ();
+	put_int (framebuffer);
+	put_int (width);
+	put_int (height);
+	put_int (clear_mask);
+	put_int (draw_buffers);
+	end_record (BIND_FRAMEBUFFER);
+}
+void Capture::use_program (GLuint program) {
+	capture_program (program);
+	begin_record ();
+	put_int (program);
+	end_record (USE_PROGRAM);
+}
+void Capture::uniform (GLuint program, const char* name, GLenum type, int count, const void* values) {
+	begin_record ();
+	put_int (program);
+	put_string (name);
+	put_int (type);
+	put_int (count);
+	put (values, count * get_uniform_components(type) * 4);
+	end_record (UNIFORM);
+}
+void Capture::clear (GLbitfield mask) {
+	begin_record ();
+	put_int (mask);
+	end_record (CLEAR);
+}
+// the state of one vertex array and the client memory it points to
+static void put_array (int index, GLint size, GLenum type, GLint normalized, GLint stride, GLint buffer, GLint divisor, const void* pointer, int vertex_count, int instances) {
+	put_int (index);
+	put_int (size);
+	put_int (type);
+	put_int (normalized);
+	put_int (stride);
+	put_int (buffer);
+	put_int (divisor);
+	if (buffer) {
+		put_int (0);
+		put_int ((int)(size_t)pointer);
+		return;
+	}
+	int element_size = size * get_type_size (type);
+	int count = divisor ? (instances + divisor - 1) / divisor : vertex_count;
+	int data_size = count > 0 ? (count - 1) * (stride ? stride : element_size) + element_size : 0;
+	put_int (data_size);
+	put (pointer, data_size);
+}
+void Capture::draw_arrays (GLenum mode, int first, int count, int instances) {
+	if (active) {
+		GLint program, framebuffer, array_buffer, active_texture, viewport[4];
+		glGetIntegerv (GL_CURRENT_PROGRAM, &program);
+		glGetIntegerv (GL_DRAW_FRAMEBUFFER_BINDING, &framebuffer);
+		glGetIntegerv (GL_ARRAY_BUFFER_BINDING, &array_buffer);
+		glGetIntegerv (GL_ACTIVE_TEXTURE, &active_texture);
+		glGetIntegerv (GL_VIEWPORT, viewport);
+		capture_program (program);
+		capture_framebuffer (framebuffer);
+		GLint textures[4][2];
+		for (int unit=0; unit<4; unit++) {
+			glActiveTexture (GL_TEXTURE0 + unit);
+			glGetIntegerv (GL_TEXTURE_BINDING_2D, &textures[unit][0]);
+			glGetIntegerv (GL_TEXTURE_BINDING_2D_ARRAY, &textures[unit][1]);
+		}
+		glActiveTexture (active_texture);
+		for (int unit=0; unit<4; unit++) {
+			capture_texture (GL_TEXTURE_2D, textures[unit][0]);
+			capture_texture (GL_TEXTURE_2D_ARRAY, textures[unit][1]);
+		}
+		
+		// the buffers behind the vertex arrays
+		const GLenum client_arrays[] = {GL_VERTEX_ARRAY, GL_NORMAL_ARRAY, GL_TEXTURE_COORD_ARRAY};
+		const GLenum client_bindings[] = {GL_VERTEX_ARRAY_BUFFER_BINDING, GL_NORMAL_ARRAY_BUFFER_BINDING, GL_TEXTURE_COORD_ARRAY_BUFFER_BINDING};
+		GLint client_enabled[3], client_buffers[3];
+		glClientActiveTexture (GL_TEXTURE0);
+		for (int i=0; i<3; i++) {
+			client_enabled[i] = glIsEnabled (client_arrays[i]);
+			glGetIntegerv (client_bindings[i], &client_buffers[i]);
+			if (client_enabled[i])
+				capture_buffer (client_buffers[i]);
+		}
+		GLint attribute_count;
+		glGetIntegerv (GL_MAX_VERTEX_ATTRIBS, &attribute_count);
+		if (attribute_count > 16) attribute_count = 16;
+		GLint attribute_enabled[16], attribute_buffers[16];
+		for (int i=0; i<attribute_count; i++) {
+			glGetVertexAttribiv (i, GL_VERTEX_ATTRIB_ARRAY_ENABLED, &attribute_enabled[i]);
+			glGetVertexAttribiv (i, GL_VERTEX_ATTRIB_ARRAY_BUFFER_BINDING, &attribute_buffers[i]);
+			if (attribute_enabled[i])
+				capture_buffer (attribute_buffers[i]);
+		}
+		
+		begin_record ();
+		put_int (mode);
+		put_int (first);
+		put_int (count);
+		put_int (instances);
+		put_int (program);
+		put_int (framebuffer);
+		put (viewport, sizeof(viewport));
+		GLfloat matrices[3][16];
+		glGetFloatv (GL_PROJECTION_MATRIX, matrices[0]);
+		glGetFloatv (GL_MODELVIEW_MATRIX, matrices[1]);
+		glGetFloatv (GL_TEXTURE_MATRIX, matrices[2]);
+		put (matrices, sizeof(matrices));
+		GLint state[6];
+		state[0] = glIsEnabled (GL_DEPTH_TEST);
+		state[1] = glIsEnabled (GL_BLEND);
+		state[2] = glIsEnabled (GL_CULL_FACE);
+		glGetIntegerv (GL_DEPTH_FUNC, &state[3]);
+		glGetIntegerv (GL_BLEND_SRC, &state[4]);
+		glGetIntegerv (GL_BLEND_DST, &state[5]);
+		put (state, sizeof(state));
+		GLboolean depth_mask;
+		glGetBooleanv (GL_DEPTH_WRITEMASK, &depth_mask);
+		put_int (depth_mask);
+		// Color::use sets the current color, the depth prepass masks the colors
+		GLfloat color[4];
+		glGetFloatv (GL_CURRENT_COLOR, color);
+		put (color, sizeof(color));
+		GLboolean color_mask[4];
+		glGetBooleanv (GL_COLOR_WRITEMASK, color_mask);
+		for (int i=0; i<4; i++)
+			put_int (color_mask[i]);
+		put (textures, sizeof(textures));
+		
+		int array_count = 0;
+		for (int i=0; i<3; i++)
+			if (client_enabled[i]) array_count++;
+		for (int i=0; i<attribute_count; i++)
+			if (attribute_enabled[i]) array_count++;
+		put_int (array_count);
+		const GLenum size_queries[] = {GL_VERTEX_ARRAY_SIZE, 0, GL_TEXTURE_COORD_ARRAY_SIZE};
+		const GLenum type_queries[] = {GL_VERTEX_ARRAY_TYPE, GL_NORMAL_ARRAY_TYPE, GL_TEXTURE_COORD_ARRAY_TYPE};
+		const GLenum stride_queries[] = {GL_VERTEX_ARRAY_STRIDE, GL_NORMAL_ARRAY_STRIDE, GL_TEXTURE_COORD_ARRAY_STRIDE};
+		const GLenum pointer_queries[] = {GL_VERTEX_ARRAY_POINTER, GL_NORMAL_ARRAY_POINTER, GL_TEXTURE_COORD_ARRAY_POINTER};
+		for (int i=0; i<3; i++) {
+			if (!client_enabled[i])
+				continue;
+			GLint size = 3, type, stride;
+			GLvoid* pointer;
+			if (size_queries[i])
+				glGetIntegerv (size_queries[i], &size);
+			glGetIntegerv (type_queries[i], &type);
+			glGetIntegerv (stride_queries[i], &stride);
+			glGetPointerv (pointer_queries[i], &pointer);
+			put_array (-1-i, size, type, GL_FALSE, stride, client_buffers[i], 0, pointer, first + count, instances);
+		}
+		for (int i=0; i<attribute_count; i++) {
+			if (!attribute_enabled[i])
+				continue;
+			GLint size, type, normalized, stride, divisor;
+			GLvoid* pointer;
+			glGetVertexAttribiv (i, GL_VERTEX_ATTRIB_ARRAY_SIZE, &size);
+			glGetVertexAttribiv (i, GL_VERTEX_ATTRIB_ARRAY_TYPE, &type);
+			glGetVertexAttribiv (i, GL_VERTEX_ATTRIB_ARRAY_NORMALIZED, &normalized);
+			glGetVertexAttribiv (i, GL_VERTEX_ATTRIB_ARRAY_STRIDE, &stride);
+			glGetVertexAttribiv (i, GL_VERTEX_ATTRIB_ARRAY_DIVISOR, &divisor);
+			glGetVertexAttribPointerv (i, GL_VERTEX_ATTRIB_ARRAY_POINTER, &pointer);
+			put_array (i, size, type, normalized, stride, attribute_buffers[i], divisor, pointer, first + count, instances);
+		}
+		end_record (DRAW);
+	}
+	if (instances > 0)
+		glDrawArraysInstanced (mode, first, count, instances);
 	else
-		fprintf (stderr, "%s unknown error\n", origin);
+		glDrawArrays (mode, first, count);
 }
@@ -12,6 +12,7 @@ All rights reserved.
 #define GL_GLEXT_PROTOTYPES
 #include <GL/gl.h>
 #include <math.h>
+#include <stddef.h>
 
 struct vec3 {
 	float x, y, z;
@@ -51,11 +52,169 @@ static vec3& operator *= (vec3& v, float s) {
 static float length (const vec3& v) {
 	return sqrt (v.x*v.x + v.y*v.y + v.z*v.z);
 }
+static float dot (const vec3& v1, const vec3& v2) {
+	return v1.x*v2.x + v1.y*v2.y + v1.z*v2.z;
+}
+static vec3 cross (const vec3& v1, const vec3& v2) {
+	return vec3 (v1.y*v2.z - v1.z*v2.y, v1.z*v2.x - v1.x*v2.z, v1.x*v2.y - v1.y*v2.x);
+}
+static vec3 normalize (const vec3& v) {
+	return v * (1.0f / length(v));
+}
 
 struct mat3 {
 	
 };
 
+// column-major like OpenGL
+struct mat4 {
+	float m[16];
+	mat4 () {}
+	static mat4 identity () {
+		mat4 r;
+		for (int i=0; i<16; i++)
+			r.m[i] = i%5 == 0 ? 1.0f : 0.0f;
+		return r;
+	}
+	static mat4 translation (const vec3& v) {
+		mat4 r = identity ();
+		r.m[12] = v.x;
+		r.m[13] = v.y;
+		r.m[14] = v.z;
+		return r;
+	}
+	// like glRotatef, the angle is in degrees
+	static mat4 rotation (float angle, const vec3& axis) {
+		vec3 a = normalize (axis);
+		float c = cos (angle * M_PI / 180.0);
+		float s = sin (angle * M_PI / 180.0);
+		mat4 r = identity ();
+		r.m[0] = a.x*a.x*(1-c) + c;
+		r.m[1] = a.y*a.x*(1-c) + a.z*s;
+		r.m[2] = a.x*a.z*(1-c) - a.y*s;
+		r.m[4] = a.x*a.y*(1-c) - a.z*s;
+		r.m[5] = a.y*a.y*(1-c) + c;
+		r.m[6] = a.y*a.z*(1-c) + a.x*s;
+		r.m[8] = a.x*a.z*(1-c) + a.y*s;
+		r.m[9] = a.y*a.z*(1-c) - a.x*s;
+		r.m[10] = a.z*a.z*(1-c) + c;
+		return r;
+	}
+	// like glFrustum
+	static mat4 frustum (float left, float right, float bottom, float top, float near, float far) {
+		mat4 r;
+		for (int i=0; i<16; i++)
+			r.m[i] = 0.0f;
+		r.m[0] = 2*near / (right-left);
+		r.m[5] = 2*near / (top-bottom);
+		r.m[8] = (right+left) / (right-left);
+		r.m[9] = (top+bottom) / (top-bottom);
+		r.m[10] = -(far+near) / (far-near);
+		r.m[11] = -1.0f;
+		r.m[14] = -2*far*near / (far-near);
+		return r;
+	}
+	static mat4 scale (const vec3& v) {
+		mat4 r = identity ();
+		r.m[0] = v.x;
+		r.m[5] = v.y;
+		r.m[10] = v.z;
+		return r;
+	}
+	// like glOrtho
+	static mat4 orthographic (float left, float right, float bottom, float top, float near, float far) {
+		mat4 r = identity ();
+		r.m[0] = 2 / (right-left);
+		r.m[5] = 2 / (top-bottom);
+		r.m[10] = -2 / (far-near);
+		r.m[12] = -(right+left) / (right-left);
+		r.m[13] = -(top+bottom) / (top-bottom);
+		r.m[14] = -(far+near) / (far-near);
+		return r;
+	}
+	static mat4 look_at (const vec3& eye, const vec3& target, const vec3& up) {
+		vec3 f = normalize (target - eye);
+		vec3 s = normalize (cross (f, up));
+		vec3 u = cross (s, f);
+		mat4 r = identity ();
+		r.m[0] = s.x; r.m[4] = s.y; r.m[8] = s.z;
+		r.m[1] = u.x; r.m[5] = u.y; r.m[9] = u.z;
+		r.m[2] = -f.x; r.m[6] = -f.y; r.m[10] = -f.z;
+		r.m[12] = -dot (s, eye);
+		r.m[13] = -dot (u, eye);
+		r.m[14] = dot (f, eye);
+		return r;
+	}
+};
+static mat4 operator * (const mat4& m1, const mat4& m2) {
+	mat4 r;
+	for (int column=0; column<4; column++) {
+		for (int row=0; row<4; row++) {
+			float sum = 0.0f;
+			for (int i=0; i<4; i++)
+				sum += m1.m[i*4+row] * m2.m[column*4+i];
+			r.m[column*4+row] = sum;
+		}
+	}
+	return r;
+}
+// transforms a point
+static vec3 operator * (const mat4& m, const vec3& v) {
+	return vec3 (
+		m.m[0]*v.x + m.m[4]*v.y + m.m[8]*v.z + m.m[12],
+		m.m[1]*v.x + m.m[5]*v.y + m.m[9]*v.z + m.m[13],
+		m.m[2]*v.x + m.m[6]*v.y + m.m[10]*v.z + m.m[14]
+	);
+}
+
+// selects the GL paths of the wrappers below; CORE needs a 4.5 core profile
+// context and uses vertex array objects and direct state access instead of
+// client arrays, bind-to-edit and the fixed-function state
+class Backend {
+	public:
+	enum Type {
+		LEGACY,
+		CORE
+	};
+	// the attribute locations of the core backend, also bound to the
+	// attributes of vertex_shader.glsl before linking
+	enum Attribute {
+		VERTEX = 0,
+		NORMAL = 1,
+		TEX_COORD = 2,
+		TANGENT = 3,
+		INSTANCE = 4 // 4 columns
+	};
+	static Type type;
+	// call once the context is current, falls back to LEGACY if the context
+	// is not a 4.5 core profile
+	static Type select (Type requested);
+};
+
+// the matrix stacks and the current color of the fixed-function pipeline;
+// the legacy backend forwards them to GL, the core backend passes them to
+// the programs as uniforms when drawing. Only texture unit 0 has a matrix.
+class Program;
+class FixedFunction {
+	public:
+	enum MatrixMode {
+		PROJECTION,
+		MODELVIEW,
+		TEXTURE
+	};
+	static void matrix_mode (MatrixMode mode);
+	static void load_identity ();
+	static void load_matrix (const mat4& matrix);
+	static void multiply (const mat4& matrix);
+	static void push_matrix ();
+	static void pop_matrix ();
+	// without a round trip to GL
+	static const mat4& get_matrix (MatrixMode mode);
+	static void set_color (float r, float g, float b, float a);
+	// sets the uniforms of program that changed since it was last drawn with
+	static void apply (Program* program);
+};
+
 class Color {
 	public:
 	float r, g, b, a;
@@ -64,7 +223,7 @@ class Color {
 	Color (aiColor3D c): r(c.r), g(c.g), b(c.b), a(1.0f) {}
 	void use () {
 		//printf ("setting the color to {%f, %f, %f, %f}\n", r, g, b, a);
-		glColor4f (r, g, b, a);
+		FixedFunction::set_color (r, g, b, a);
 	}
 };
 
@@ -72,19 +231,74 @@ class Projection {
 	public:
 	static void perspective (double left, double right, double bottom, double top, double near, double far);
 	static void orthographic (double left, double right, double bottom, double top, double near, double far);
+	// scales the texture coordinates of unit 0, used to sample a part of a render target
+	static void scale_texture_coordinates (float s, float t);
+};
+
+// keeps track of the GPU memory used by the wrappers below
+class ResourceManager {
+	public:
+	enum Category {
+		TEXTURE,
+		BUFFER,
+		FRAMEBUFFER,
+		SHADER,
+		PROGRAM,
+		VERTEX_ARRAY,
+		CATEGORY_COUNT
+	};
+	static int add (Category category, size_t size, const char* tag);
+	static void resize (int resource, size_t size);
+	static void remove (int resource);
+	// kept until the process exits, so not reported as a leak
+	static void set_persistent (int resource);
+	static int get_count (Category category);
+	static size_t get_total (Category category);
+	static size_t get_total ();
+	static size_t get_high_water_mark ();
+	static void print_statistics ();
+	static void print_leaks ();
 };
 
 class Program;
+struct DecodedImage;
+// images decoded on any thread for the Textures that are created from them
+// later, each image is taken by one Texture and the rest is freed with the
+// set; not synchronized, hand it over as a whole
+class DecodedImages {
+	DecodedImage* first;
+	DecodedImages (const DecodedImages& images);
+	DecodedImages& operator = (const DecodedImages& images);
+public:
+	DecodedImages ();
+	~DecodedImages ();
+	bool decode (const char* filename);
+	// NULL if the file was not decoded, the caller frees the data
+	unsigned char* take (const char* filename, int* width, int* height);
+};
+
+struct TextureStream;
 class Texture {
 	int texture_unit;
+	int resource;
+	TextureStream* stream;
 	Texture (const Texture& texture);
 	Texture& operator = (const Texture& texture);
+	void load_streamed (const char* filename, DecodedImages* images);
+	void unload_streamed ();
+	friend class TextureStreamer;
 public:
 	GLuint identifier;
-	int width, height;
+	GLenum target;
+	int width, height, layers;
 	static Program* program;
-	Texture (const char* filename);
-	Texture (int width, int height, GLenum format);
+	static size_t get_size (int width, int height, GLenum format);
+	// a streamed texture starts with only its low mip levels resident; the
+	// pixels are taken from images if it decoded the file
+	Texture (const char* filename, bool streamed = false, DecodedImages* images = NULL);
+	Texture (int width, int height, GLenum format, const char* tag = "Texture");
+	// a GL_TEXTURE_2D_ARRAY
+	Texture (int width, int height, int layers, GLenum format, const char* tag = "Texture");
 	~Texture ();
 	void bind (int texture_unit = 0);
 	void unbind ();
@@ -92,26 +306,84 @@ public:
 	void draw (float x, float y, float w, float h = 0.0f);
 	void get_data (void* data);
 	void debug_print ();
+	// requests the mip levels needed to cover screen_size pixels
+	void request (float screen_size);
 };
 
+// loads the higher mip levels of streamed textures asynchronously and evicts
+// the least recently used ones to stay within the budget
+class TextureStreamer {
+	static void evict (Texture* texture);
+	static bool make_room (size_t size, Texture* keep);
+	public:
+	// when disabled, streamed textures are loaded completely at creation, for
+	// offline rendering where every frame has to be final
+	static bool enabled;
+	// VRAM budget in bytes for everything registered with the ResourceManager
+	static size_t budget;
+	// the largest mip level that is always resident
+	static int resident_size;
+	// pixels covered by one unit at a distance of one unit, set by the camera
+	static float screen_scale;
+	// counts of the last call to update
+	static int streamed;
+	static int evicted;
+	static int budget_limited;
+	static int frame;
+	// call once per frame
+	static void update ();
+	// stops the loader thread until the next load, also runs at exit
+	static void shutdown ();
+};
+
+// applies the FixedFunction state for the core backend and draws, recorded
+// by Capture while active
+void draw_arrays (GLenum mode, int first, int count, int instances = 0);
 void draw_2_textures (Texture* t1, Texture* t2, Program* p);
 void draw_3_textures (Texture* t1, Texture* t2, Texture* t3, Program* p);
 
 class Buffer {
+	int resource;
 	Buffer (const Buffer& buffer);
 	Buffer& operator = (const Buffer& buffer);
 public:
 	GLuint identifier;
-	Buffer (int size);
+	GLenum target;
+	Buffer (int size, const char* tag = "Buffer");
+	Buffer (int size, GLenum target, GLenum usage, const char* tag = "Buffer");
 	~Buffer ();
 	void bind ();
 	void unbind ();
 	void set_data (int offset, int size, void* data);
+	void* map (GLenum access);
+	void unmap ();
+	void set_persistent ();
+};
+
+// a vertex array object for the core backend, its attributes are set up
+// once instead of before every draw
+class VertexArray {
+	int resource;
+	VertexArray (const VertexArray& vertex_array);
+	VertexArray& operator = (const VertexArray& vertex_array);
+public:
+	GLuint identifier;
+	VertexArray (const char* tag = "VertexArray");
+	~VertexArray ();
+	// the attribute reads size components from buffer, starting at offset
+	void set_attribute (GLuint index, Buffer* buffer, int offset, int stride, int size, GLenum type = GL_FLOAT, int divisor = 0);
+	void disable_attribute (GLuint index);
+	void bind ();
+	void unbind ();
+	void set_persistent ();
 };
 
 class FramebufferObject {
+	int resource;
 	public:
 	int width, height;
+	// the part that is rendered to, smaller than the textures for dynamic resolution
+	int viewport_width, viewport_height;
 	GLuint identifier;
 	GLuint depth_renderbuffer;
 	Texture* color_texture;
@@ -120,37 +392,121 @@ class FramebufferObject {
 	//FramebufferObject (Texture* texture = NULL, bool depth = false);
 	//FramebufferObject (Texture* color = NULL, Texture* depth = NULL);
 	FramebufferObject (int width, int height, GLenum texture_format = GL_RGBA32F);
+	// layered, all layers are rendered to at once; layers comes last and
+	// without defaults so that (width, height, format) never ends up here
+	FramebufferObject (int width, int height, GLenum texture_format, int layers);
 	~FramebufferObject ();
 	void bind ();
 	void unbind ();
 	void attach_texture (Texture* texture);
+	void set_viewport (int width, int height);
 };
 
 class Shader {
+	int resource;
 	public:
 	GLuint identifier;
-	Shader (const char* filename, GLenum type);
+	// defines is inserted before the source, e.g. "#define FOG\n"
+	Shader (const char* filename, GLenum type, const char* defines = NULL);
 	~Shader ();
 };
 
 class Program {
+	int resource;
+	// the FixedFunction uniforms, looked up on first use
+	GLint fixed_function_locations[5];
+	bool fixed_function_located;
+	int fixed_function_version;
+	void link_program ();
+	friend class FixedFunction;
 	public:
+	// the program that was used last
+	static Program* current;
 	GLuint identifier;
 	Program (Shader* vertex_shader, Shader* fragment_shader);
-	Program (const char* vertex_shader, const char* fragment_shader);
+	Program (const char* vertex_shader, const char* fragment_shader, const char* defines = NULL);
 	Program ();
 	~Program ();
 	void attach_shader (Shader* shader);
 	void link ();
 	void use ();
 	void set_uniform_int (const char* name, int value);
+	void set_uniform_float (const char* name, float value);
 	void set_uniform_vec3 (const char* name, const vec3& value);
+	void set_uniform_mat4 (const char* name, const mat4* values, int count = 1);
 	int get_attribute_location (const char* name);
+	// for programs that are created once and never deleted
+	void set_persistent ();
 };
 
+// compiles every combination of features of a program only once
+class ProgramCache {
+	public:
+	// feature_names[i] is defined if bit i of features is set
+	static Program* get (const char* vertex_shader, const char* fragment_shader, int features, const char* const* feature_names);
+	static int get_count ();
+	// changes with every clear, which deletes the programs handed out
+	static int generation;
+	static void clear ();
+};
+
+// reports GL errors through a KHR_debug (or GL_ARB_debug_output) message
+// callback, so nothing ever waits for glGetError; compiled out with NDEBUG
 class Error {
 	public:
-	static void print (const char* origin);
+#ifdef NDEBUG
+	static void enable (GLenum min_severity = 0) {}
+	static void label (GLenum type, GLuint identifier, const char* name) {}
+#else
+	// repeated messages are counted instead of printed, the counts and the
+	// number of messages over the rate limit are reported at exit
+	static int max_messages_per_second;
+	static void enable (GLenum min_severity = GL_DEBUG_SEVERITY_LOW);
+	static void label (GLenum type, GLuint identifier, const char* name);
+#endif
+};
+
+// records the GL calls made through the classes above and the draw paths
+// during one frame into a binary trace, together with the contents of every
+// texture, buffer, program and framebuffer they use; replay.cpp plays it back
+class Capture {
+	public:
+	enum Call {
+		BEGIN = 1,
+		DEFINE_TEXTURE,
+		DEFINE_BUFFER,
+		DEFINE_PROGRAM,
+		DEFINE_FRAMEBUFFER,
+		BIND_TEXTURE,
+		BIND_BUFFER,
+		BUFFER_SUB_DATA,
+		BIND_FRAMEBUFFER,
+		USE_PROGRAM,
+		UNIFORM,
+		CLEAR,
+		DRAW,
+		END
+	};
+	// the client arrays in DRAW records, generic attributes use their index
+	enum Array {
+		VERTEX_ARRAY = -1,
+		NORMAL_ARRAY = -2,
+		TEXTURE_COORD_ARRAY = -3
+	};
+	static bool active;
+	// call before and after the frame to record, legacy backend only
+	static bool start (const char* filename);
+	static void stop ();
+	// called by the wrappers while active
+	static void bind_texture (int unit, GLenum target, GLuint texture);
+	static void bind_buffer (GLenum target, GLuint buffer);
+	static void buffer_sub_data (GLenum target, int offset, int size, const void* data);
+	static void bind_framebuffer (GLuint framebuffer, int width, int height, GLbitfield clear_mask, int draw_buffers);
+	static void use_program (GLuint program);
+	static void uniform (GLuint program, const char* name, GLenum type, int count, const void* values);
+	static void clear (GLbitfield mask);
+	// records the state the draw depends on, then draws
+	static void draw_arrays (GLenum mode, int first, int count, int instances = 0);
 };
 
 #endif // FOUNDATION_HPP
@@ -15,50 +15,211 @@ All rights reserved.
 
 namespace infra {
 
-class ResourceManager {
-	~ResourceManager ();
-};
-
 class Material {
 	public:
+	// the #defines of material.glsl and vertex_shader.glsl
+	enum Feature {
+		COLORMAP = 1<<0,
+		NORMALMAP = 1<<1,
+		SPECULAR = 1<<2,
+		FOG = 1<<3,
+		INSTANCING = 1<<4,
+		MULTIVIEW = 1<<5
+	};
+	static const char* feature_names[];
 	Color color;
 	Texture* colormap;
 	Texture* normalmap;
+	int features;
+	// the variant that was activated last, owned by the ProgramCache
 	Program* program;
+	// the variants resolved so far by the INSTANCING and MULTIVIEW bits of
+	// extra_features, valid for cached_features and cached_generation
+	Program* programs[4];
+	int cached_features;
+	int cached_generation;
 	//float hardness;
 	//float light_size;
-	Material (aiMaterial* material);
+	// the textures take their pixels from images if it decoded them
+	Material (aiMaterial* material, DecodedImages* images = NULL);
 	~Material ();
-	void activate ();
+	Program* get_program (int extra_features = 0);
+	void activate (int extra_features = 0);
+	void request (float screen_size);
 	void deactivate ();
 };
 
+// the views of a MultiViewCamera, passed down to the meshes
+struct ViewSet {
+	enum {MAX_VIEWS = 16};
+	int count;
+	mat4 view_matrices[MAX_VIEWS];
+	mat4 projection;
+	// the programs that have received the matrices of the current frame
+	List<Program*> programs;
+	void use (Program* program);
+};
+
+struct Ray {
+	vec3 origin;
+	vec3 direction; // normalized
+	float max_distance;
+	Ray () {}
+	Ray (const vec3& origin, const vec3& direction, float max_distance = 1e30f): origin(origin), direction(direction), max_distance(max_distance) {}
+};
+class Instance;
+class Mesh;
+struct RayHit {
+	float distance;
+	Instance* instance;
+	Mesh* mesh;
+	int triangle;
+	float u, v; // barycentric coordinates
+};
+
+// a 4-wide bounding volume hierarchy node, the bounds of the children are
+// stored together so they are tested at once with SSE
+struct BVHNode {
+	float min_x[4], min_y[4], min_z[4];
+	float max_x[4], max_y[4], max_z[4];
+	// an inner node if count is 0, otherwise a leaf with the primitives
+	// first to first+count-1, unused children have a count of -1
+	int child[4];
+	int count[4];
+};
+
+// the triangles of a mesh kept on the CPU for ray queries
+class MeshGeometry {
+	List<BVHNode> nodes;
+	// per triangle in BVH order: a vertex and the two edges from it
+	List<float> triangles;
+	List<int> triangle_indices;
+public:
+	vec3 min, max;
+	MeshGeometry (const aiMesh* mesh);
+	int get_triangle_count ();
+	// hit.distance limits the query and is lowered on a closer hit
+	bool intersect (const Ray& ray, RayHit& hit, bool any_hit);
+};
+
 class Mesh {
+	static Program* depth_program;
+	int enable_arrays ();
+	void disable_arrays (int tangent_index);
 	public:
 	unsigned int vertex_count;
 	Buffer buffer;
 	Material material;
-	Mesh (aiMesh* mesh, const aiScene* scene);
+	vec3 center;
+	float radius;
+	// NULL unless the Object keeps its geometry
+	MeshGeometry* geometry;
+	// prebuilt for the core backend, NULL with the legacy one
+	VertexArray* vertex_array;
+	Mesh (aiMesh* mesh, const aiScene* scene, bool keep_geometry = false, DecodedImages* images = NULL);
+	~Mesh ();
 	void draw ();
+	// transforms contains a column-major model matrix per instance
+	void draw_instanced (Buffer* transforms, int count);
+	// draws into every view in mask at once
+	void draw_views (ViewSet* views, unsigned int mask);
+	void draw_depth ();
 };
 
 class Object {
+	Object (const Object& object);
+	Object& operator = (const Object& object);
+	// the meshes and their materials, allocated in one block
+	Mesh* mesh_arena;
+	void create (const aiScene* scene, bool keep_geometry, DecodedImages* images);
 public:
+	// point into mesh_arena
 	List<Mesh*> meshes;
-	Object (const char* filename);
+	// bounding sphere
+	vec3 center;
+	float radius;
+	// an object without meshes
+	Object ();
+	// keep_geometry keeps the triangles on the CPU for ray queries
+	Object (const char* filename, bool keep_geometry = false);
+	// from a scene that was already imported, for example on another thread;
+	// images can hold the decoded textures of the materials
+	Object (const aiScene* scene, bool keep_geometry = false, DecodedImages* images = NULL);
+	~Object ();
+	void precompile ();
 	void draw ();
+	void draw_views (ViewSet* views, unsigned int mask);
+	void draw_depth ();
 };
 
+class Scene;
 class Instance {
+	friend class Scene;
 	Object* object;
+	Instance* parent;
+	// the scene the instance was added to, and its node once the hierarchy
+	// is built (-1 before); cleared when either side goes away
+	Scene* scene;
+	int node;
 protected:
-	Instance () {}
+	Instance (): object(NULL), parent(NULL), scene(NULL), node(-1) {}
+	void apply_transform ();
 public:
 	Instance (Object* object);
 	Instance (Object* object, vec3 position);
+	// removes itself from its scene
+	virtual ~Instance ();
+	// relative to the parent
 	vec3 position;
 	vec3 rotation;
+	Object* get_object ();
+	Instance* get_parent ();
+	mat4 get_local_transform ();
+	// the world transform, as of the last Scene::update_transforms; the scene
+	// updates before drawing, moves in between need another call to show here
+	mat4 get_transform ();
+	vec3 get_world_position ();
 	virtual void draw ();
+	virtual void draw_views (ViewSet* views, unsigned int mask);
+	virtual void draw_depth ();
+};
+
+// refers to an instance of an InstanceStore, a removed instance's handle
+// stays invalid even if its slot is reused
+struct InstanceHandle {
+	unsigned int slot;
+	unsigned int generation;
+};
+
+// instances kept in contiguous arrays instead of individually allocated
+// Instances; removal moves the last instance into the gap. They have no
+// Instance, so the hierarchy, the front-to-back sort of Scene, SceneBVH and
+// MultiViewCamera do not see them; Scene draws them after its instances
+class InstanceStore {
+	// per slot
+	List<unsigned int> generations;
+	List<int> indices; // -1 for free slots
+	List<unsigned int> free_slots;
+	// per instance, the slot it belongs to
+	List<unsigned int> slots;
+public:
+	enum Flag {
+		VISIBLE = 1<<0
+	};
+	// per instance, indexed from 0 to count()-1
+	List<mat4> transforms;
+	List<Object*> objects;
+	List<unsigned int> flags;
+	int count ();
+	InstanceHandle add (Object* object, const mat4& transform, unsigned int flags = VISIBLE);
+	bool remove (InstanceHandle handle);
+	bool is_valid (InstanceHandle handle);
+	// the index into the arrays, -1 for an invalid handle
+	int get_index (InstanceHandle handle);
+	void draw ();
+	void draw_depth ();
+	// compares the store with a List of Instances at 1k, 10k and 100k instances
+	static void benchmark ();
 };
 
 class Light {
@@ -68,14 +229,88 @@ class Light {
 public:
 	vec3 position;
 	Light (float x, float y, float z);
-	void draw (Texture* color, Texture* normal, Texture* positionmap);
+	void draw (Texture* color, Texture* normal, Texture* positionmap, const GLfloat* view_matrix);
 };
 
 class Scene {
+	List<Instance*> draw_order;
+	// the transform hierarchy as arrays in breadth-first order, so parents
+	// come before their children and every level is a contiguous range
+	List<Instance*> nodes;
+	List<int> parents;
+	List<vec3> positions;
+	List<vec3> rotations;
+	List<mat4> local_matrices;
+	List<mat4> world_matrices;
+	// the update in which a node changed, children inherit it from the parent
+	List<int> changed;
+	List<int> levels;
+	int update;
+	// instances were added, removed or reparented since the last update
+	bool dirty;
+	// the instances and parents the hierarchy was built from
+	List<Instance*> built_instances;
+	List<Instance*> built_parents;
+	bool hierarchy_changed ();
+	void build_hierarchy ();
+	friend class Instance;
 	public:
+	// change with add and remove, so that the hierarchy notices
 	List<Instance*> instances;
+	// instances without hierarchy, drawn after the ones above
+	InstanceStore store;
 	List<Light> lights;
+	Scene ();
+	// the instances stay alive, they are only detached
+	~Scene ();
+	void add (Instance* instance);
+	// the children of the instance become roots
+	void remove (Instance* instance);
+	// child follows the transform of parent, NULL detaches it
+	bool set_parent (Instance* child, Instance* parent);
+	// recomputes the world matrices of the moved subtrees, returns their
+	// number; the draw paths call it, without changes it only compares the
+	// positions and rotations
+	int update_transforms ();
+	void sort (const vec3& eye);
+	// compiles the material variants used by the instances
+	void precompile ();
 	void draw ();
+	void draw_depth ();
+};
+
+// ray queries against the instances of a scene whose objects keep their geometry
+class SceneBVH {
+	Scene* scene;
+	List<BVHNode> nodes;
+	List<Instance*> instances;
+	List<mat4> inverse_transforms;
+	vec3 min, max;
+	bool intersect_instance (int index, const Ray& ray, RayHit& hit, bool any_hit);
+public:
+	SceneBVH (Scene* scene);
+	// call after instances have been added or moved
+	void build ();
+	bool intersect (const Ray& ray, RayHit& hit, bool any_hit = false);
+	// a batch of queries distributed over threads
+	void intersect (const Ray* rays, RayHit* hits, int count, bool any_hit, int thread_count);
+	// measures random rays through the scene, returns rays per second
+	double benchmark (int ray_count, bool any_hit, int thread_count);
+};
+
+// remembers the state of a scene to detect changes between frames
+class SceneSnapshot {
+	List<Instance*> instances;
+	List<Instance*> parents;
+	List<vec3> transforms;
+	List<mat4> store_transforms;
+	List<Object*> store_objects;
+	List<unsigned int> store_flags;
+	List<vec3> lights;
+public:
+	// both return true if something changed since the last call
+	bool update_geometry (Scene* scene);
+	bool update_lights (Scene* scene);
 };
 
 class Window {
@@ -84,10 +319,44 @@ public:
 	~Window ();
 };
 
+// an OpenGL context without a window or display, rendering goes to
+// framebuffer objects
+class HeadlessContext {
+	void* display;
+	void* context;
+public:
+	HeadlessContext ();
+	~HeadlessContext ();
+	// a CORE context is 4.5 core profile, without one it falls back to LEGACY
+	bool create (Backend::Type backend = Backend::LEGACY);
+};
+
+// adjusts the render scale to keep the GPU frame time within a budget
+class DynamicResolution {
+	GLuint queries[3];
+	bool pending[3];
+	int frame;
+	void update ();
+public:
+	float target_time; // milliseconds
+	float min_scale, max_scale;
+	float scale;
+	float gpu_time; // milliseconds, of the latest measured frame
+	// prints the scale at the end of every frame, off by default
+	bool report;
+	DynamicResolution (float target_time, float min_scale = 0.5f, float max_scale = 1.0f);
+	~DynamicResolution ();
+	// bracket the GPU work of a frame, DeferredRenderingCamera::take_a_picture
+	// calls them for its own dynamic_resolution
+	void begin_frame ();
+	void end_frame ();
+};
+
 class Camera {
 protected:
 	bool direct_rendering;
 	int width, height;
+	void apply_view ();
 public:
 	vec3 position;
 	Scene* scene;
@@ -102,15 +371,72 @@ public:
 	void look_at (float x, float y, float z);
 };
 
+class BloomEffect;
 class DeferredRenderingCamera: public Camera {
+	static Program* upscale_program;
 	FramebufferObject* target;
 	Texture* normal_texture;
 	Texture* position_texture;
 	FramebufferObject* result;
+	GLuint overdraw_query;
+	bool overdraw_query_pending;
+	int overdraw_pixels;
+	// the state the G-buffer and the result were rendered with
+	SceneSnapshot snapshot;
+	bool valid;
+	vec3 cached_position;
+	Instance* cached_track;
+	vec3 cached_track_position;
+	GLfloat view_matrix[16];
+	Texture* output;
+	void draw_geometry (float scale);
+	void draw_lights (float scale, float s, float t);
 public:
+	enum RenderPath {
+		FULL,
+		LIGHTING_ONLY,
+		SKIPPED
+	};
+	// the path taken by the last frame and how often each path was taken
+	RenderPath path;
+	int full_frames, lighting_only_frames, skipped_frames;
+	// lay down depth with a position-only pass first so that the material
+	// shaders only run once per pixel (G-buffer pass uses GL_EQUAL)
+	bool depth_prepass;
+	// shaded fragments per pixel of the G-buffer pass, updated when the
+	// query result of a previous frame becomes available
+	bool measure_overdraw;
+	float overdraw;
+	// renders into a part of the targets and upscales the result when set
+	DynamicResolution* dynamic_resolution;
+	float sharpness;
+	BloomEffect* bloom;
 	DeferredRenderingCamera (Scene* scene, int width, int height);
 	~DeferredRenderingCamera ();
 	virtual void take_a_picture ();
+	// forces a full redraw, e.g. after a material was changed
+	void invalidate ();
+};
+
+// renders the scene from several views into the layers of an array texture,
+// traversing and submitting the scene only once
+class MultiViewCamera: public Camera {
+	FramebufferObject* target;
+	ViewSet views;
+	unsigned int get_view_mask (Instance* instance);
+public:
+	float field_of_view; // horizontal, in degrees
+	// per frame: instances submitted, and the sum of the instances visible in
+	// each view (what rendering the views separately would submit)
+	int submitted_instances;
+	int view_instances;
+	MultiViewCamera (Scene* scene, int width, int height, int view_count);
+	~MultiViewCamera ();
+	void set_view (int view, const vec3& position, const vec3& target, const vec3& up = vec3(0.0f,1.0f,0.0f));
+	// six 90 degree views at position, in the order of the cube map faces
+	void set_cube_map (const vec3& position);
+	Texture* get_result ();
+	virtual void take_a_picture ();
 };
 
 class BloomEffect {
@@ -118,8 +444,148 @@ class BloomEffect {
 	FramebufferObject* intermediate_result;
 	FramebufferObject* result;
 	static Program* program;
+	static Program* combine_program;
 	BloomEffect (int width, int height);
-	void apply (Texture* input);
+	~BloomEffect ();
+	// scale is the part of input (and result) that is rendered to, input has
+	// to be the size the effect was created with
+	void apply (Texture* input, float scale = 1.0f);
+};
+
+// a batch of frames to render, read from a text file with one setting per line:
+//   scene models/room.obj
+//   resolution 1920 1080
+//   frames 0 239
+//   output frames/%04d.png        (.png or .exr, %d is the frame number)
+//   camera 0  0 2 10  0 1 0       (keyframe: frame, position, target)
+//   orbit 0 1 0  10  3  1         (turntable: center, radius, height, turns)
+struct BatchJob {
+	enum Format {PNG, EXR};
+	struct Keyframe {
+		int frame;
+		vec3 position, target;
+	};
+	char scene_file[256];
+	char output_pattern[256];
+	Format format;
+	int width, height;
+	int first_frame, last_frame;
+	List<Keyframe> camera_path;
+	bool orbit;
+	vec3 orbit_center;
+	float orbit_radius, orbit_height, orbit_turns;
+	BatchJob ();
+	bool load (const char* filename);
+	void get_camera (int frame, vec3& position, vec3& target) const;
+};
+
+// renders a BatchJob offscreen; the readback goes through a ring of pixel
+// buffers so the GPU keeps rendering, and the frames are encoded to disk by
+// a pool of threads
+class BatchRenderer {
+public:
+	int encoder_threads;
+	int readback_buffers;
+	// frames waiting for an encoder, bounds the memory use; when the queue is
+	// full the renderer blocks until an encoder takes a frame
+	int max_queued_frames;
+	// statistics of the last run
+	int frames_rendered;
+	int frames_encoded;
+	double seconds;
+	double fps;
+	int max_queue_depth;
+	float average_queue_depth;
+	// how often the renderer was blocked because the queue was full
+	int encoder_stalls;
+	BatchRenderer (int encoder_threads = 4, int readback_buffers = 3, int max_queued_frames = 32);
+	bool run (const BatchJob& job);
+};
+
+// a world larger than memory, divided into square cells on the xz plane
+// that are loaded on other threads as the camera approaches them and
+// unloaded again when it moves away; the workers parse the files and decode
+// the material images, the main thread only uploads
+struct WorldAsset {
+	char filename[256];
+	vec3 position;
+	// around the y axis, in degrees
+	float rotation;
+};
+struct WorldLoad;
+struct WorldCell {
+	enum State {
+		UNLOADED,
+		LOADING,
+		LOADED
+	};
+	int x, z;
+	List<WorldAsset> assets;
+	State state;
+	// the sum of the file sizes
+	size_t file_size;
+	// the GPU memory while loaded, the file size until the first load
+	size_t memory;
+	WorldLoad* load;
+	List<Object*> objects;
+	List<InstanceHandle> handles;
+	// from the request until the instances are in the scene, in milliseconds
+	double latency;
+	double read_time;
+	// of the material images, on the worker
+	double decode_time;
+	double upload_time;
+	int load_count;
+};
+struct WorldQueue;
+class WorldStreamer {
+	Scene* scene;
+	WorldQueue* queue;
+	List<WorldCell*> cells;
+	vec3 last_position;
+	double last_time;
+	bool stalled;
+	double stall_start;
+	WorldCell* get_cell (int x, int z, bool create);
+	float get_distance (const WorldCell* cell, const vec3& position);
+	void request (WorldCell* cell);
+	void finish (WorldCell* cell);
+	void unload (WorldCell* cell);
+public:
+	float cell_size;
+	// cells closer than load_distance are loaded, cells farther than
+	// unload_distance are unloaded, the gap keeps cells at the border from
+	// being reloaded every time the camera turns around
+	float load_distance;
+	float unload_distance;
+	// how many seconds of travel ahead are prefetched
+	float prefetch_time;
+	// GPU memory of the loaded cells in bytes, 0 for no limit
+	size_t memory_budget;
+	// bytes of files being read at once and the number of cells in flight
+	size_t io_budget;
+	int max_loads;
+	int worker_threads;
+	// the velocity estimated from the camera movement
+	vec3 velocity;
+	// statistics
+	size_t memory;
+	int loaded_cells;
+	int loads_in_flight;
+	size_t bytes_in_flight;
+	// frames in which the cell of the camera was not loaded
+	int stalls;
+	double stall_time;
+	// the main thread time spent creating the objects during the last update
+	double last_upload_time;
+	WorldStreamer (Scene* scene, float cell_size = 64.0f, int worker_threads = 2);
+	~WorldStreamer ();
+	void add (const char* filename, const vec3& position, float rotation = 0.0f);
+	// one "object file x y z [rotation]" per line
+	bool load (const char* filename);
+	// call once per frame
+	void update (const Camera* camera);
+	void print_statistics ();
 };
 
 class DeferredRendering {
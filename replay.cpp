@@ -0,0 +1,524 @@
+/*
+
+Copyright © 2012-2015 Elias Aebi
+
+All rights reserved.
+
+*/
+
+// replays a frame recorded with Capture without a window, in a loop, and
+// reports the CPU and GPU time of every call
+//   replay trace.bin [iterations]
+
+#include "infra.hpp"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+using namespace infra;
+
+struct Record {
+	int call;
+	int size;
+	const unsigned char* data;
+	// accumulated over the iterations, in milliseconds
+	double cpu_time;
+	double gpu_time;
+	GLuint query;
+};
+
+struct Reader {
+	const unsigned char* p;
+	Reader (const unsigned char* p): p(p) {}
+	int get_int () {
+		int value;
+		memcpy (&value, p, 4);
+		p += 4;
+		return value;
+	}
+	const void* get_data (int size) {
+		const void* data = p;
+		p += size;
+		return data;
+	}
+	// returns a zero terminated copy, to be freed
+	char* get_string () {
+		int length = get_int ();
+		char* string = (char*) malloc (length + 1);
+		memcpy (string, get_data(length), length);
+		string[length] = '\0';
+		return string;
+	}
+};
+
+static const char* call_names[] = {"", "BEGIN", "DEFINE_TEXTURE", "DEFINE_BUFFER", "DEFINE_PROGRAM", "DEFINE_FRAMEBUFFER", "BIND_TEXTURE", "BIND_BUFFER", "BUFFER_SUB_DATA", "BIND_FRAMEBUFFER", "USE_PROGRAM", "UNIFORM", "CLEAR", "DRAW", "END"};
+
+// the replay names of the captured objects, indexed by the captured names
+static List<GLuint> textures;
+static List<GLuint> buffers;
+static List<GLuint> programs;
+static List<GLuint> framebuffers;
+static GLuint get_name (List<GLuint>& names, GLuint captured) {
+	return captured < (GLuint)names.count() ? names[captured] : 0;
+}
+static void set_name (List<GLuint>& names, GLuint captured, GLuint name) {
+	while ((GLuint)names.count() <= captured)
+		names.append (0);
+	names[captured] = name;
+}
+
+static double get_milliseconds () {
+	timespec t;
+	clock_gettime (CLOCK_MONOTONIC, &t);
+	return t.tv_sec * 1e3 + t.tv_nsec * 1e-6;
+}
+
+static void set_uniform (GLint location, GLenum type, int count, const void* values) {
+	const GLfloat* f = (const GLfloat*) values;
+	const GLint* i = (const GLint*) values;
+	switch (type) {
+		case GL_FLOAT: glUniform1fv (location, count, f); break;
+		case GL_FLOAT_VEC2: glUniform2fv (location, count, f); break;
+		case GL_FLOAT_VEC3: glUniform3fv (location, count, f); break;
+		case GL_FLOAT_VEC4: glUniform4fv (location, count, f); break;
+		case GL_FLOAT_MAT3: glUniformMatrix3fv (location, count, GL_FALSE, f); break;
+		case GL_FLOAT_MAT4: glUniformMatrix4fv (location, count, GL_FALSE, f); break;
+		case GL_INT_VEC2: glUniform2iv (location, count, i); break;
+		case GL_INT_VEC3: glUniform3iv (location, count, i); break;
+		case GL_INT_VEC4: glUniform4iv (location, count, i); break;
+		// int, bool and samplers
+		default: glUniform1iv (location, count, i); break;
+	}
+}
+static int get_uniform_components (GLenum type) {
+	switch (type) {
+		case GL_FLOAT_VEC2: case GL_INT_VEC2: return 2;
+		case GL_FLOAT_VEC3: case GL_INT_VEC3: return 3;
+		case GL_FLOAT_VEC4: case GL_INT_VEC4: return 4;
+		case GL_FLOAT_MAT3: return 9;
+		case GL_FLOAT_MAT4: return 16;
+		default: return 1;
+	}
+}
+
+// DEFINE_TEXTURE and DEFINE_BUFFER are uploaded again before every
+// iteration, so every iteration starts from the captured contents
+static void upload_texture (const Record& record) {
+	Reader r (record.data);
+	GLuint captured = r.get_int ();
+	GLenum target = r.get_int ();
+	GLuint texture = get_name (textures, captured);
+	if (!texture) {
+		glGenTextures (1, &texture);
+		set_name (textures, captured, texture);
+	}
+	glBindTexture (target, texture);
+	const GLenum parameters[] = {GL_TEXTURE_MIN_FILTER, GL_TEXTURE_MAG_FILTER, GL_TEXTURE_WRAP_S, GL_TEXTURE_WRAP_T, GL_TEXTURE_BASE_LEVEL, GL_TEXTURE_MAX_LEVEL};
+	for (int i=0; i<6; i++)
+		glTexParameteri (target, parameters[i], r.get_int());
+	int level_count = r.get_int ();
+	for (int i=0; i<level_count; i++) {
+		int level = r.get_int ();
+		GLint format = r.get_int ();
+		int width = r.get_int ();
+		int height = r.get_int ();
+		int depth = r.get_int ();
+		GLenum pixel_format = r.get_int ();
+		GLenum type = r.get_int ();
+		int size = r.get_int ();
+		const void* pixels = r.get_data (size);
+		if (target == GL_TEXTURE_2D_ARRAY)
+			glTexImage3D (target, level, format, width, height, depth, 0, pixel_format, type, pixels);
+		else
+			glTexImage2D (target, level, format, width, height, 0, pixel_format, type, pixels);
+	}
+	glBindTexture (target, 0);
+}
+static void upload_buffer (const Record& record) {
+	Reader r (record.data);
+	GLuint captured = r.get_int ();
+	int size = r.get_int ();
+	GLuint buffer = get_name (buffers, captured);
+	glBindBuffer (GL_ARRAY_BUFFER, buffer);
+	if (!buffer) {
+		glGenBuffers (1, &buffer);
+		set_name (buffers, captured, buffer);
+		glBindBuffer (GL_ARRAY_BUFFER, buffer);
+		glBufferData (GL_ARRAY_BUFFER, size, r.get_data(size), GL_STATIC_DRAW);
+	}
+	else
+		glBufferSubData (GL_ARRAY_BUFFER, 0, size, r.get_data(size));
+	glBindBuffer (GL_ARRAY_BUFFER, 0);
+}
+// compiles and links the program the first time, then sets the captured uniform values
+static void define_program (const Record& record) {
+	Reader r (record.data);
+	GLuint captured = r.get_int ();
+	GLuint program = get_name (programs, captured);
+	bool create = program == 0;
+	if (create) {
+		program = glCreateProgram ();
+		set_name (programs, captured, program);
+	}
+	int shader_count = r.get_int ();
+	for (int i=0; i<shader_count; i++) {
+		GLenum type = r.get_int ();
+		char* source = r.get_string ();
+		if (create) {
+			GLuint shader = glCreateShader (type);
+			glShaderSource (shader, 1, (const GLchar**)&source, NULL);
+			glCompileShader (shader);
+			glAttachShader (program, shader);
+			glDeleteShader (shader);
+		}
+		free (source);
+	}
+	// the same attribute locations as in the application
+	int attribute_count = r.get_int ();
+	for (int i=0; i<attribute_count; i++) {
+		int location = r.get_int ();
+		char* name = r.get_string ();
+		if (create)
+			glBindAttribLocation (program, location, name);
+		free (name);
+	}
+	if (create) {
+		glLinkProgram (program);
+		GLint status;
+		glGetProgramiv (program, GL_LINK_STATUS, &status);
+		if (status == GL_FALSE)
+			fprintf (stderr, "replay: program %u failed to link\n", captured);
+	}
+	glUseProgram (program);
+	int uniform_count = r.get_int ();
+	for (int i=0; i<uniform_count; i++) {
+		char* name = r.get_string ();
+		GLenum type = r.get_int ();
+		const void* values = r.get_data (get_uniform_components(type) * 4);
+		set_uniform (glGetUniformLocation(program, name), type, 1, values);
+		free (name);
+	}
+	glUseProgram (0);
+}
+static void define_framebuffer (const Record& record) {
+	Reader r (record.data);
+	GLuint captured = r.get_int ();
+	if (get_name(framebuffers, captured))
+		return;
+	GLuint framebuffer;
+	glGenFramebuffers (1, &framebuffer);
+	set_name (framebuffers, captured, framebuffer);
+	glBindFramebuffer (GL_FRAMEBUFFER, framebuffer);
+	int attachment_count = r.get_int ();
+	for (int i=0; i<attachment_count; i++) {
+		GLenum attachment = r.get_int ();
+		GLenum type = r.get_int ();
+		GLuint name = r.get_int ();
+		int layered = r.get_int ();
+		int width = r.get_int ();
+		int height = r.get_int ();
+		GLenum format = r.get_int ();
+		if (type == GL_RENDERBUFFER) {
+			GLuint renderbuffer;
+			glGenRenderbuffers (1, &renderbuffer);
+			glBindRenderbuffer (GL_RENDERBUFFER, renderbuffer);
+			glRenderbufferStorage (GL_RENDERBUFFER, format, width, height);
+			glBindRenderbuffer (GL_RENDERBUFFER, 0);
+			glFramebufferRenderbuffer (GL_FRAMEBUFFER, attachment, GL_RENDERBUFFER, renderbuffer);
+		}
+		else if (layered)
+			glFramebufferTexture (GL_FRAMEBUFFER, attachment, get_name(textures, name), 0);
+		else
+			glFramebufferTexture2D (GL_FRAMEBUFFER, attachment, GL_TEXTURE_2D, get_name(textures, name), 0);
+	}
+	if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE)
+		fprintf (stderr, "replay: framebuffer %u is incomplete\n", captured);
+	glBindFramebuffer (GL_FRAMEBUFFER, 0);
+}
+
+static void draw (const Record& record) {
+	Reader r (record.data);
+	GLenum mode = r.get_int ();
+	int first = r.get_int ();
+	int count = r.get_int ();
+	int instances = r.get_int ();
+	glUseProgram (get_name(programs, r.get_int()));
+	glBindFramebuffer (GL_FRAMEBUFFER, get_name(framebuffers, r.get_int()));
+	const GLint* viewport = (const GLint*) r.get_data (4*4);
+	glViewport (viewport[0], viewport[1], viewport[2], viewport[3]);
+	const GLenum matrix_modes[] = {GL_PROJECTION, GL_MODELVIEW, GL_TEXTURE};
+	for (int i=0; i<3; i++) {
+		glMatrixMode (matrix_modes[i]);
+		glLoadMatrixf ((const GLfloat*)r.get_data(16*4));
+	}
+	glMatrixMode (GL_MODELVIEW);
+	const GLenum capabilities[] = {GL_DEPTH_TEST, GL_BLEND, GL_CULL_FACE};
+	for (int i=0; i<3; i++) {
+		if (r.get_int()) glEnable (capabilities[i]);
+		else glDisable (capabilities[i]);
+	}
+	glDepthFunc (r.get_int());
+	GLenum blend_source = r.get_int ();
+	glBlendFunc (blend_source, r.get_int());
+	glDepthMask (r.get_int());
+	glColor4fv ((const GLfloat*)r.get_data(4*4));
+	GLboolean color_mask[4];
+	for (int i=0; i<4; i++)
+		color_mask[i] = r.get_int ();
+	glColorMask (color_mask[0], color_mask[1], color_mask[2], color_mask[3]);
+	for (int unit=0; unit<4; unit++) {
+		glActiveTexture (GL_TEXTURE0 + unit);
+		glBindTexture (GL_TEXTURE_2D, get_name(textures, r.get_int()));
+		glBindTexture (GL_TEXTURE_2D_ARRAY, get_name(textures, r.get_int()));
+	}
+	glActiveTexture (GL_TEXTURE0);
+	
+	// only the captured arrays are enabled
+	glDisableClientState (GL_VERTEX_ARRAY);
+	glDisableClientState (GL_NORMAL_ARRAY);
+	glDisableClientState (GL_TEXTURE_COORD_ARRAY);
+	for (int i=0; i<16; i++) {
+		glDisableVertexAttribArray (i);
+		glVertexAttribDivisor (i, 0);
+	}
+	int array_count = r.get_int ();
+	for (int i=0; i<array_count; i++) {
+		int index = r.get_int ();
+		int size = r.get_int ();
+		GLenum type = r.get_int ();
+		GLboolean normalized = r.get_int ();
+		int stride = r.get_int ();
+		GLuint buffer = r.get_int ();
+		int divisor = r.get_int ();
+		int data_size = r.get_int ();
+		const void* pointer = buffer ? (const void*)(size_t)r.get_int() : r.get_data (data_size);
+		glBindBuffer (GL_ARRAY_BUFFER, get_name(buffers, buffer));
+		if (index == Capture::VERTEX_ARRAY) {
+			glEnableClientState (GL_VERTEX_ARRAY);
+			glVertexPointer (size, type, stride, pointer);
+		}
+		else if (index == Capture::NORMAL_ARRAY) {
+			glEnableClientState (GL_NORMAL_ARRAY);
+			glNormalPointer (type, stride, pointer);
+		}
+		else if (index == Capture::TEXTURE_COORD_ARRAY) {
+			glEnableClientState (GL_TEXTURE_COORD_ARRAY);
+			glTexCoordPointer (size, type, stride, pointer);
+		}
+		else {
+			glEnableVertexAttribArray (index);
+			glVertexAttribPointer (index, size, type, normalized, stride, pointer);
+			glVertexAttribDivisor (index, divisor);
+		}
+	}
+	glBindBuffer (GL_ARRAY_BUFFER, 0);
+	if (instances > 0)
+		glDrawArraysInstanced (mode, first, count, instances);
+	else
+		glDrawArrays (mode, first, count);
+}
+
+static void execute (const Record& record) {
+	Reader r (record.data);
+	switch (record.call) {
+	case Capture::BIND_TEXTURE: {
+		int unit = r.get_int ();
+		GLenum target = r.get_int ();
+		glActiveTexture (GL_TEXTURE0 + unit);
+		glBindTexture (target, get_name(textures, r.get_int()));
+		break;
+	}
+	case Capture::BIND_BUFFER: {
+		GLenum target = r.get_int ();
+		glBindBuffer (target, get_name(buffers, r.get_int()));
+		break;
+	}
+	case Capture::BUFFER_SUB_DATA: {
+		GLenum target = r.get_int ();
+		int offset = r.get_int ();
+		int size = r.get_int ();
+		glBufferSubData (target, offset, size, r.get_data(size));
+		break;
+	}
+	case Capture::BIND_FRAMEBUFFER: {
+		glBindFramebuffer (GL_FRAMEBUFFER, get_name(framebuffers, r.get_int()));
+		int width = r.get_int ();
+		int height = r.get_int ();
+		GLbitfield clear_mask = r.get_int ();
+		int draw_buffers = r.get_int ();
+		if (width > 0)
+			glViewport (0, 0, width, height);
+		if (clear_mask)
+			glClear (clear_mask);
+		if (draw_buffers > 1 && draw_buffers <= 4) {
+			GLenum buffers[] = {GL_COLOR_ATTACHMENT0, GL_COLOR_ATTACHMENT1, GL_COLOR_ATTACHMENT2, GL_COLOR_ATTACHMENT3};
+			glDrawBuffers (draw_buffers, buffers);
+		}
+		break;
+	}
+	case Capture::USE_PROGRAM:
+		glUseProgram (get_name(programs, r.get_int()));
+		break;
+	case Capture::UNIFORM: {
+		GLuint program = get_name (programs, r.get_int());
+		char* name = r.get_string ();
+		GLenum type = r.get_int ();
+		int count = r.get_int ();
+		glUseProgram (program);
+		set_uniform (glGetUniformLocation(program, name), type, count, r.get_data(count * get_uniform_components(type) * 4));
+		free (name);
+		break;
+	}
+	case Capture::CLEAR:
+		glClear (r.get_int());
+		break;
+	case Capture::DRAW:
+		draw (record);
+		break;
+	}
+}
+
+int main (int argc, char** argv) {
+	if (argc < 2) {
+		fprintf (stderr, "usage: %s trace [iterations]\n", argv[0]);
+		return 1;
+	}
+	int iterations = argc > 2 ? atoi (argv[2]) : 100;
+	FILE* file = fopen (argv[1], "rb");
+	if (!file) {
+		fprintf (stderr, "replay: failed to open %s\n", argv[1]);
+		return 1;
+	}
+	fseek (file, 0, SEEK_END);
+	long length = ftell (file);
+	rewind (file);
+	unsigned char* trace = (unsigned char*) malloc (length);
+	fread (trace, 1, length, file);
+	fclose (file);
+	if (length < 8 || memcmp(trace, "GLTRACE1", 8) != 0) {
+		fprintf (stderr, "replay: %s is not a trace\n", argv[1]);
+		return 1;
+	}
+	
+	HeadlessContext context;
+	if (!context.create ())
+		return 1;
+	
+	List<Record> records;
+	for (long offset=8; offset+8<=length; ) {
+		Record record;
+		Reader r (trace + offset);
+		record.call = r.get_int ();
+		record.size = r.get_int ();
+		record.data = trace + offset + 8;
+		record.cpu_time = 0.0;
+		record.gpu_time = 0.0;
+		record.query = 0;
+		offset += 8 + record.size;
+		if (offset > length || record.call < Capture::BEGIN || record.call > Capture::END) {
+			fprintf (stderr, "replay: the trace is truncated\n");
+			break;
+		}
+		records.append (record);
+	}
+	
+	// create the objects; the captured default framebuffer becomes an offscreen one
+	GLuint initial_framebuffer = 0;
+	GLint viewport[4] = {0, 0, 1, 1};
+	FramebufferObject* default_framebuffer = NULL;
+	int call_count = 0;
+	for (int i=0; i<records.count(); i++) {
+		Record& record = records[i];
+		switch (record.call) {
+		case Capture::BEGIN: {
+			Reader r (record.data);
+			initial_framebuffer = r.get_int ();
+			memcpy (viewport, r.get_data(sizeof(viewport)), sizeof(viewport));
+			default_framebuffer = new FramebufferObject (viewport[0] + viewport[2], viewport[1] + viewport[3], GL_RGBA8);
+			set_name (framebuffers, 0, default_framebuffer->identifier);
+			break;
+		}
+		case Capture::DEFINE_TEXTURE: upload_texture (record); break;
+		case Capture::DEFINE_BUFFER: upload_buffer (record); break;
+		case Capture::DEFINE_PROGRAM: define_program (record); break;
+		case Capture::DEFINE_FRAMEBUFFER: define_framebuffer (record); break;
+		case Capture::END: break;
+		default:
+			glGenQueries (1, &record.query);
+			call_count++;
+		}
+	}
+	printf ("replay: %d calls, %d textures, %d buffers, %d programs, %d framebuffers\n", call_count, textures.count(), buffers.count(), programs.count(), framebuffers.count());
+	
+	double cpu_total = 0.0;
+	double gpu_total = 0.0;
+	for (int iteration=0; iteration<iterations; iteration++) {
+		// back to the captured contents, not timed
+		for (int i=0; i<records.count(); i++) {
+			if (records[i].call == Capture::DEFINE_TEXTURE) upload_texture (records[i]);
+			else if (records[i].call == Capture::DEFINE_BUFFER) upload_buffer (records[i]);
+			else if (records[i].call == Capture::DEFINE_PROGRAM) define_program (records[i]);
+		}
+		glBindFramebuffer (GL_FRAMEBUFFER, get_name(framebuffers, initial_framebuffer));
+		glViewport (viewport[0], viewport[1], viewport[2], viewport[3]);
+		glFinish ();
+		
+		double frame_start = get_milliseconds ();
+		for (int i=0; i<records.count(); i++) {
+			Record& record = records[i];
+			if (!record.query)
+				continue;
+			double start = get_milliseconds ();
+			glBeginQuery (GL_TIME_ELAPSED, record.query);
+			execute (record);
+			glEndQuery (GL_TIME_ELAPSED);
+			record.cpu_time += get_milliseconds() - start;
+		}
+		glFinish ();
+		cpu_total += get_milliseconds() - frame_start;
+		for (int i=0; i<records.count(); i++) {
+			if (!records[i].query)
+				continue;
+			GLuint64 nanoseconds = 0;
+			glGetQueryObjectui64v (records[i].query, GL_QUERY_RESULT, &nanoseconds);
+			records[i].gpu_time += nanoseconds * 1e-6;
+			gpu_total += nanoseconds * 1e-6;
+		}
+	}
+	
+	// the most expensive calls first
+	List<int> order;
+	for (int i=0; i<records.count(); i++)
+		if (records[i].query) order.append (i);
+	for (int i=1; i<order.count(); i++) {
+		int j = i;
+		while (j > 0 && records[order[j-1]].gpu_time < records[order[j]].gpu_time) {
+			int t = order[j];
+			order[j] = order[j-1];
+			order[j-1] = t;
+			j--;
+		}
+	}
+	printf ("replay: %d iterations, per frame %.3f ms wall, %.3f ms GPU\n", iterations, cpu_total / iterations, gpu_total / iterations);
+	printf ("%8s  %-18s %10s %10s\n", "record", "call", "GPU us", "CPU us");
+	for (int k=0; k<order.count() && k<30; k++) {
+		const Record& record = records[order[k]];
+		printf ("%8d  %-18s %10.2f %10.2f", order[k], call_names[record.call], record.gpu_time * 1e3 / iterations, record.cpu_time * 1e3 / iterations);
+		if (record.call == Capture::DRAW) {
+			Reader r (record.data);
+			r.get_int ();
+			r.get_int ();
+			int count = r.get_int ();
+			int instances = r.get_int ();
+			printf ("  %d vertices x %d, program %d", count, instances > 0 ? instances : 1, r.get_int());
+		}
+		printf ("\n");
+	}
+	
+	for (int i=0; i<records.count(); i++)
+		if (records[i].query) glDeleteQueries (1, &records[i].query);
+	delete default_framebuffer;
+	free (trace);
+	return 0;
+}
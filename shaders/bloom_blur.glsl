@@ -0,0 +1,25 @@
+/*
+
+Copyright © 2012-2015 Elias Aebi
+
+All rights reserved.
+
+*/
+
+uniform sampler2D texture;
+uniform vec3 step; // one texel in the direction of the blur
+uniform vec3 limit; // the end of the rendered part of the texture
+
+vec4 bright (const in vec2 p) {
+	return max (texture2D (texture, min (p, limit.xy)) - vec4(0.8), vec4(0.0));
+}
+
+void main () {
+	vec2 p = gl_TexCoord[0].st;
+	vec4 color = bright (p) * 0.227027;
+	color += (bright (p + step.xy) + bright (p - step.xy)) * 0.1945946;
+	color += (bright (p + step.xy*2.0) + bright (p - step.xy*2.0)) * 0.1216216;
+	color += (bright (p + step.xy*3.0) + bright (p - step.xy*3.0)) * 0.054054;
+	color += (bright (p + step.xy*4.0) + bright (p - step.xy*4.0)) * 0.016216;
+	gl_FragColor = color;
+}
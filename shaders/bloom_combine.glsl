@@ -0,0 +1,26 @@
+/*
+
+Copyright © 2012-2015 Elias Aebi
+
+All rights reserved.
+
+*/
+
+uniform sampler2D t1; // input
+uniform sampler2D t2; // horizontally blurred
+uniform vec3 step; // one texel in the direction of the blur
+uniform vec3 limit; // the end of the rendered part of the texture
+
+vec4 blurred (const in vec2 p) {
+	return texture2D (t2, min (p, limit.xy));
+}
+
+void main () {
+	vec2 p = gl_TexCoord[0].st;
+	vec4 color = blurred (p) * 0.227027;
+	color += (blurred (p + step.xy) + blurred (p - step.xy)) * 0.1945946;
+	color += (blurred (p + step.xy*2.0) + blurred (p - step.xy*2.0)) * 0.1216216;
+	color += (blurred (p + step.xy*3.0) + blurred (p - step.xy*3.0)) * 0.054054;
+	color += (blurred (p + step.xy*4.0) + blurred (p - step.xy*4.0)) * 0.016216;
+	gl_FragColor = texture2D (t1, p) + color;
+}
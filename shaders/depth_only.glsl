@@ -0,0 +1,11 @@
+/*
+
+Copyright © 2012-2015 Elias Aebi
+
+All rights reserved.
+
+*/
+
+void main () {
+	
+}
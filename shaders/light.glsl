@@ -0,0 +1,28 @@
+/*
+
+Copyright © 2012-2015 Elias Aebi
+
+All rights reserved.
+
+*/
+
+uniform sampler2D t1; // color
+uniform sampler2D t2; // normal
+uniform sampler2D t3; // eye space position
+uniform vec3 light_position;
+uniform vec3 light_color;
+uniform float light_size;
+
+void main () {
+	vec4 position = texture2D (t3, gl_TexCoord[0].st);
+	// nothing was drawn here
+	if (position.w == 0.0)
+		discard;
+	vec4 color = texture2D (t1, gl_TexCoord[0].st);
+	vec3 normal = normalize (texture2D (t2, gl_TexCoord[0].st).xyz);
+	vec3 light = light_position - position.xyz;
+	float distance = length (light);
+	float diffuse = max (dot (normal, light / distance), 0.0);
+	float attenuation = light_size / (light_size + distance * distance);
+	gl_FragColor = vec4 (color.rgb * light_color * diffuse * attenuation, 0.0);
+}
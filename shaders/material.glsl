@@ -6,35 +6,68 @@ All rights reserved.
 
 */
 
+// features: COLORMAP, NORMALMAP, SPECULAR, FOG
+
 varying mat3 TBN;
 varying vec4 real_position;
-
-float angle (const in vec3 v1, const in vec3 v2) {
-	return acos( dot(v1,v2) / (length(v1)*length(v2)) );
-}
+#ifdef COLORMAP
+uniform sampler2D colormap;
+#endif
+#ifdef NORMALMAP
+uniform sampler2D normalmap;
+#endif
 
 vec4 diffuse (const in vec4 color, const in vec3 normal, const in vec3 light) {
 	return color * (dot (normal, light) * 0.5 + 0.75);
 }
 
+#ifdef SPECULAR
 vec4 specular (const in vec4 color, const in vec3 normal, const in vec3 light, const in vec3 eye) {
-	float a = angle (reflect(light,normal), eye);
-	if (degrees(a) < 30.0)
-		return color * (cos (6.0*a) * 0.5 + 0.5);
+	// cos(6a) for angles below 30 degrees, without acos and cos
+	float c = dot (normalize (reflect (light, normal)), normalize (eye));
+	if (c > 0.8660254) {
+		float c2 = c * c;
+		return color * ((((32.0 * c2 - 48.0) * c2 + 18.0) * c2 - 1.0) * 0.5 + 0.5);
+	}
 	else
 		return vec4 (0.0);
 }
+#endif
 
+#ifdef FOG
 vec4 fog (const in vec4 color, const in float distance, const in vec4 fog_color) {
-	return mix (fog_color, color, pow(0.99,distance));
+	// pow(0.99,distance)
+	return mix (fog_color, color, exp2 (-0.0144996 * distance));
 }
+#endif
 
 void main () {
+#ifdef COLORMAP
+	vec4 color = texture2D (colormap, gl_TexCoord[0].st);
+#else
+	vec4 color = gl_Color;
+#endif
+#ifdef NORMALMAP
+	// split the normalmap
+	vec4 normalmap_sample = texture2D (normalmap, gl_TexCoord[0].st);
+	float specular_coefficient = normalmap_sample.a;
+	vec3 normal = normalize (TBN * (normalmap_sample.rgb * 2.0 - 1.0));
+#else
+	float specular_coefficient = 1.0;
 	vec3 normal = normalize (TBN[2]);
+#endif
 	// diffuse
-	gl_FragColor = diffuse (gl_Color, normal, vec3(0.0,0.0,1.0));
+	vec4 shaded = diffuse (color, normal, vec3(0.0,0.0,1.0));
+#ifdef SPECULAR
 	// specular
-	gl_FragColor += specular (gl_Color, normal, vec3(0.0,0.0,1.0), real_position.xyz);
+	shaded += specular (color, normal, vec3(0.0,0.0,1.0), real_position.xyz) * specular_coefficient;
+#endif
+#ifdef FOG
 	// fog
-	gl_FragColor = fog (gl_FragColor, -real_position.z, vec4(0.9,0.9,0.9,1.0));
+	shaded = fog (shaded, -real_position.z, vec4(0.9,0.9,0.9,1.0));
+#endif
+	gl_FragData[0] = shaded;
+	// G-buffer (ignored when rendering directly)
+	gl_FragData[1] = vec4 (normal, specular_coefficient);
+	gl_FragData[2] = vec4 (real_position.xyz, 1.0);
 }
@@ -0,0 +1,45 @@
+#version 150 compatibility
+#extension GL_ARB_shader_viewport_layer_array : require
+/*
+
+Copyright © 2012-2015 Elias Aebi
+
+All rights reserved.
+
+*/
+
+// vertex_shader.glsl for MultiViewCamera: every GL instance renders the mesh
+// into the layer of one view, the modelview matrix contains only the model
+
+#define MAX_VIEWS 16
+
+attribute vec3 in_tangent;
+uniform mat4 view_matrices[MAX_VIEWS];
+uniform mat4 projection_matrix;
+// a bit for every view that can see the mesh
+uniform int view_mask;
+varying mat3 TBN;
+varying vec4 real_position;
+
+void main () {
+	int view = gl_InstanceID;
+	mat4 view_matrix = view_matrices[view];
+	vec4 world_position = gl_ModelViewMatrix * gl_Vertex;
+	real_position = view_matrix * world_position;
+	if ((view_mask & (1 << view)) != 0)
+		gl_Position = projection_matrix * real_position;
+	else
+		// outside of the clip volume, the primitive is discarded
+		gl_Position = vec4 (2.0, 2.0, 2.0, 1.0);
+	gl_Layer = view;
+	gl_FrontColor = gl_Color;
+	gl_BackColor = gl_Color;
+	gl_TexCoord[0] = gl_TextureMatrix[0] * gl_MultiTexCoord0;
+	
+	// TBN
+	mat3 normal_matrix = mat3 (view_matrix) * gl_NormalMatrix;
+	vec3 normal = normalize (normal_matrix * gl_Normal);
+	vec3 tangent = normalize (normal_matrix * in_tangent);
+	vec3 binormal = cross (normal, tangent);
+	TBN = mat3 (tangent, binormal, normal);
+}
@@ -0,0 +1,13 @@
+/*
+
+Copyright © 2012-2015 Elias Aebi
+
+All rights reserved.
+
+*/
+
+void main () {
+	// ftransform matches the position computed by vertex_shader.glsl exactly,
+	// which is required for the GL_EQUAL depth test after the pre-pass
+	gl_Position = ftransform ();
+}
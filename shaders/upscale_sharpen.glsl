@@ -0,0 +1,24 @@
+/*
+
+Copyright © 2012-2015 Elias Aebi
+
+All rights reserved.
+
+*/
+
+uniform sampler2D texture;
+uniform vec3 texel; // the size of a texel in texture coordinates
+uniform vec3 limit; // the end of the rendered part of the texture
+uniform float sharpness;
+
+vec4 fetch (const in vec2 p) {
+	return texture2D (texture, min (p, limit.xy));
+}
+
+void main () {
+	vec2 p = gl_TexCoord[0].st;
+	vec4 color = fetch (p);
+	vec4 neighbors = fetch (p + vec2(texel.x, 0.0)) + fetch (p - vec2(texel.x, 0.0)) + fetch (p + vec2(0.0, texel.y)) + fetch (p - vec2(0.0, texel.y));
+	// unsharp mask
+	gl_FragColor = color + (color * 4.0 - neighbors) * 0.25 * sharpness;
+}
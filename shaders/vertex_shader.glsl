@@ -6,22 +6,40 @@ All rights reserved.
 
 */
 
+// features: INSTANCING
+
 attribute vec3 in_tangent;
+#ifdef INSTANCING
+// the columns of the model matrix of the instance
+attribute vec4 in_instance_0;
+attribute vec4 in_instance_1;
+attribute vec4 in_instance_2;
+attribute vec4 in_instance_3;
+#endif
 varying mat3 TBN;
 varying vec4 real_position;
 
 void main () {
-	gl_Position = gl_ModelViewProjectionMatrix * gl_Vertex;
+#ifdef INSTANCING
+	mat4 model = mat4 (in_instance_0, in_instance_1, in_instance_2, in_instance_3);
+	vec4 vertex = model * gl_Vertex;
+	mat3 normal_matrix = gl_NormalMatrix * mat3 (model[0].xyz, model[1].xyz, model[2].xyz);
+	gl_Position = gl_ModelViewProjectionMatrix * vertex;
+#else
+	vec4 vertex = gl_Vertex;
+	mat3 normal_matrix = gl_NormalMatrix;
+	gl_Position = ftransform ();
+#endif
 	gl_FrontColor = gl_Color;
 	gl_BackColor = gl_Color;
 	gl_TexCoord[0] = gl_TextureMatrix[0] * gl_MultiTexCoord0;
 	
 	// TBN
-	vec3 normal = normalize (gl_NormalMatrix * gl_Normal);
-	vec3 tangent = normalize (gl_NormalMatrix * in_tangent);
+	vec3 normal = normalize (normal_matrix * gl_Normal);
+	vec3 tangent = normalize (normal_matrix * in_tangent);
 	vec3 binormal = cross (normal, tangent);
 	TBN = mat3 (tangent, binormal, normal);
 	
 	// real position
-	real_position = gl_ModelViewMatrix * gl_Vertex;
+	real_position = gl_ModelViewMatrix * vertex;
 }
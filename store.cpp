@@ -0,0 +1,208 @@
+/*
+
+Copyright © 2012-2015 Elias Aebi
+
+All rights reserved.
+
+*/
+
+#include "infra.hpp"
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+namespace infra {
+
+// InstanceStore
+int InstanceStore::count () {
+	return transforms.count ();
+}
+InstanceHandle InstanceStore::add (Object* object, const mat4& transform, unsigned int flags) {
+	InstanceHandle handle;
+	if (free_slots.count() > 0) {
+		handle.slot = free_slots[free_slots.count()-1];
+		free_slots.remove_last ();
+	}
+	else {
+		handle.slot = generations.count ();
+		generations.append (0);
+		indices.append (-1);
+	}
+	handle.generation = generations[handle.slot];
+	indices[handle.slot] = transforms.count ();
+	slots.append (handle.slot);
+	transforms.append (transform);
+	objects.append (object);
+	this->flags.append (flags);
+	return handle;
+}
+bool InstanceStore::remove (InstanceHandle handle) {
+	int index = get_index (handle);
+	if (index < 0)
+		return false;
+	// move the last instance into the gap
+	int last = transforms.count() - 1;
+	if (index != last) {
+		transforms[index] = transforms[last];
+		objects[index] = objects[last];
+		flags[index] = flags[last];
+		slots[index] = slots[last];
+		indices[slots[index]] = index;
+	}
+	transforms.remove_last ();
+	objects.remove_last ();
+	flags.remove_last ();
+	slots.remove_last ();
+	indices[handle.slot] = -1;
+	generations[handle.slot]++;
+	free_slots.append (handle.slot);
+	return true;
+}
+bool InstanceStore::is_valid (InstanceHandle handle) {
+	return handle.slot < (unsigned int)generations.count() && generations[handle.slot] == handle.generation && indices[handle.slot] >= 0;
+}
+int InstanceStore::get_index (InstanceHandle handle) {
+	return is_valid(handle) ? indices[handle.slot] : -1;
+}
+void InstanceStore::draw () {
+	for (int i=0; i<transforms.count(); i++) {
+		if (!(flags[i] & VISIBLE))
+			continue;
+		FixedFunction::push_matrix ();
+		FixedFunction::multiply (transforms[i]);
+		objects[i]->draw ();
+		FixedFunction::pop_matrix ();
+	}
+}
+void InstanceStore::draw_depth () {
+	for (int i=0; i<transforms.count(); i++) {
+		if (!(flags[i] & VISIBLE))
+			continue;
+		FixedFunction::push_matrix ();
+		FixedFunction::multiply (transforms[i]);
+		objects[i]->draw_depth ();
+		FixedFunction::pop_matrix ();
+	}
+}
+
+// benchmark
+static double get_milliseconds () {
+	timespec t;
+	clock_gettime (CLOCK_MONOTONIC, &t);
+	return t.tv_sec * 1e3 + t.tv_nsec * 1e-6;
+}
+static unsigned int next_random (unsigned int& seed) {
+	seed = seed * 1664525u + 1013904223u;
+	return seed >> 8;
+}
+// a typical per frame pass: move every instance and count the ones near the eye
+static int update_list (List<Instance*>& instances, const vec3& eye) {
+	int visible = 0;
+	for (int i=0; i<instances.count(); i++) {
+		Instance* instance = instances[i];
+		Object* object = instance->get_object ();
+		if (!object)
+			continue;
+		instance->position.x += 0.001f;
+		vec3 center = instance->position + object->center;
+		if (length(center - eye) - object->radius < 50.0f)
+			visible++;
+	}
+	return visible;
+}
+static int update_store (InstanceStore& store, const vec3& eye) {
+	int visible = 0;
+	int count = store.count ();
+	if (count == 0)
+		return 0;
+	mat4* transforms = &store.transforms[0];
+	Object** objects = &store.objects[0];
+	unsigned int* flags = &store.flags[0];
+	for (int i=0; i<count; i++) {
+		if (!(flags[i] & InstanceStore::VISIBLE))
+			continue;
+		float* m = transforms[i].m;
+		m[12] += 0.001f;
+		vec3 center = vec3 (m[12], m[13], m[14]) + objects[i]->center;
+		if (length(center - eye) - objects[i]->radius < 50.0f)
+			visible++;
+	}
+	return visible;
+}
+void InstanceStore::benchmark () {
+	const int counts[] = {1000, 10000, 100000};
+	const int frames = 20;
+	Object objects[8];
+	for (int i=0; i<8; i++) {
+		objects[i].center = vec3 (0.0f, 0.5f*i, 0.0f);
+		objects[i].radius = 1.0f + i;
+	}
+	vec3 eye (0.0f, 0.0f, 0.0f);
+	for (int c=0; c<3; c++) {
+		int count = counts[c];
+		unsigned int seed = 1;
+		List<Instance*> list;
+		List<void*> padding;
+		InstanceStore store;
+		List<InstanceHandle> handles;
+		for (int i=0; i<count; i++) {
+			vec3 position ((next_random(seed) % 2000) * 0.1f - 100.0f, 0.0f, (next_random(seed) % 2000) * 0.1f - 100.0f);
+			Object* object = &objects[next_random(seed) % 8];
+			// other allocations in between, like in a running application
+			padding.append (malloc(16 + next_random(seed) % 256));
+			list.append (new Instance(object, position));
+			handles.append (store.add(object, mat4::translation(position)));
+		}
+		// the order of the list no longer matches the memory after some churn
+		for (int i=count-1; i>0; i--) {
+			int j = next_random(seed) % (i+1);
+			Instance* t = list[i];
+			list[i] = list[j];
+			list[j] = t;
+		}
+		
+		int visible = 0;
+		double start = get_milliseconds ();
+		for (int f=0; f<frames; f++)
+			visible += update_list (list, eye);
+		double list_time = (get_milliseconds() - start) / frames;
+		start = get_milliseconds ();
+		for (int f=0; f<frames; f++)
+			visible -= update_store (store, eye);
+		double store_time = (get_milliseconds() - start) / frames;
+		if (visible != 0)
+			fprintf (stderr, "InstanceStore::benchmark: the layouts disagree\n");
+		
+		// replace 10% of the instances, both remove by moving the last one into
+		// the gap so that only the allocations differ
+		int churn = count / 10;
+		start = get_milliseconds ();
+		for (int i=0; i<churn; i++) {
+			int j = next_random(seed) % list.count();
+			Instance* instance = list[j];
+			list[j] = list[list.count()-1];
+			list.remove_last ();
+			list.append (new Instance(instance->get_object(), instance->position));
+			delete instance;
+		}
+		double list_churn = get_milliseconds() - start;
+		start = get_milliseconds ();
+		for (int i=0; i<churn; i++) {
+			int j = next_random(seed) % handles.count();
+			int index = store.get_index (handles[j]);
+			Object* object = store.objects[index];
+			mat4 transform = store.transforms[index];
+			store.remove (handles[j]);
+			handles[j] = store.add (object, transform);
+		}
+		double store_churn = get_milliseconds() - start;
+		
+		printf ("InstanceStore::benchmark: %d instances: update %.3f ms (List) %.3f ms (store), replacing %d: %.3f ms (List) %.3f ms (store)\n", count, list_time, store_time, churn, list_churn, store_churn);
+		for (int i=0; i<list.count(); i++)
+			delete list[i];
+		for (int i=0; i<padding.count(); i++)
+			free (padding[i]);
+	}
+}
+
+}
@@ -1,4 +1,5 @@
 #include <vector>
+#include <algorithm>
 
 template <class T> class List: private std::vector<T> {
 	typedef std::vector<T> parent;
@@ -9,6 +10,18 @@ public:
 	void append (const T& element) {
 		parent::push_back (element);
 	}
+	void remove (int i) {
+		parent::erase (parent::begin() + i);
+	}
+	void remove_last () {
+		parent::pop_back ();
+	}
+	void clear () {
+		parent::clear ();
+	}
+	template <class C> void sort (C compare) {
+		std::sort (parent::begin(), parent::end(), compare);
+	}
 	T& get (int i) {
 		return parent::operator [] (i);
 	}
@@ -0,0 +1,428 @@
+/*
+
+Copyright © 2012-2015 Elias Aebi
+
+All rights reserved.
+
+*/
+
+#include "infra.hpp"
+#include <assimp/Importer.hpp>
+#include <assimp/postprocess.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+
+namespace infra {
+
+// the files of one cell, imported by a worker together with the images of
+// their materials; the objects are created on the main thread since they
+// need the GL context
+struct WorldLoad {
+	WorldCell* cell;
+	// the distinct files of the cell
+	List<const char*> filenames;
+	List<Assimp::Importer*> importers;
+	List<const aiScene*> scenes;
+	// the images the worker decoded, taken by the Textures of the objects
+	DecodedImages images;
+	double request_time;
+	double read_time;
+	double decode_time;
+};
+struct WorldQueue {
+	pthread_mutex_t mutex;
+	pthread_cond_t condition;
+	List<pthread_t> threads;
+	List<WorldLoad*> pending;
+	List<WorldLoad*> done;
+	bool quit;
+};
+
+static double get_milliseconds () {
+	timespec t;
+	clock_gettime (CLOCK_MONOTONIC, &t);
+	return t.tv_sec * 1e3 + t.tv_nsec * 1e-6;
+}
+static void delete_load (WorldLoad* load) {
+	for (int i=0; i<load->importers.count(); i++)
+		delete load->importers[i];
+	// frees the images no Texture took
+	delete load;
+}
+// the textures Material creates, once per mesh since every mesh has its own
+// Material, so that they are not decoded on the GL thread
+static void decode_images (WorldLoad* load, const aiScene* scene) {
+	const aiTextureType types[] = {aiTextureType_DIFFUSE, aiTextureType_NORMALS};
+	for (unsigned int i=0; i<scene->mNumMeshes; i++) {
+		aiMaterial* material = scene->mMaterials[scene->mMeshes[i]->mMaterialIndex];
+		for (int t=0; t<2; t++) {
+			if (!material->GetTextureCount(types[t]))
+				continue;
+			aiString path;
+			material->GetTexture (types[t], 0, &path);
+			load->images.decode (path.C_Str());
+		}
+	}
+}
+static void* world_worker (void* data) {
+	WorldQueue* queue = (WorldQueue*) data;
+	pthread_mutex_lock (&queue->mutex);
+	while (true) {
+		while (queue->pending.count() == 0 && !queue->quit)
+			pthread_cond_wait (&queue->condition, &queue->mutex);
+		if (queue->quit)
+			break;
+		WorldLoad* load = queue->pending[0];
+		queue->pending.remove (0);
+		pthread_mutex_unlock (&queue->mutex);
+		
+		// reading and parsing is the slow part
+		double start = get_milliseconds ();
+		for (int i=0; i<load->filenames.count(); i++) {
+			Assimp::Importer* importer = new Assimp::Importer ();
+			const aiScene* scene = importer->ReadFile (load->filenames[i], aiProcess_CalcTangentSpace|aiProcess_Triangulate);
+			if (!scene)
+				fprintf (stderr, "WorldStreamer: an error occurred reading %s: %s\n", load->filenames[i], importer->GetErrorString());
+			load->importers.append (importer);
+			load->scenes.append (scene);
+		}
+		double decode_start = get_milliseconds ();
+		load->read_time = decode_start - start;
+		for (int i=0; i<load->scenes.count(); i++) {
+			if (load->scenes[i])
+				decode_images (load, load->scenes[i]);
+		}
+		load->decode_time = get_milliseconds() - decode_start;
+		
+		pthread_mutex_lock (&queue->mutex);
+		queue->done.append (load);
+	}
+	pthread_mutex_unlock (&queue->mutex);
+	return NULL;
+}
+
+struct CellCandidate {
+	WorldCell* cell;
+	float distance;
+};
+struct CloserCell {
+	bool operator () (const CellCandidate& c1, const CellCandidate& c2) {
+		return c1.distance < c2.distance;
+	}
+};
+
+WorldStreamer::WorldStreamer (Scene* scene, float cell_size, int worker_threads): scene(scene), last_position(0.0f,0.0f,0.0f), last_time(0.0), stalled(false), stall_start(0.0), cell_size(cell_size), load_distance(2.0f*cell_size), unload_distance(3.0f*cell_size), prefetch_time(2.0f), memory_budget(0), io_budget(64*1024*1024), max_loads(4), worker_threads(worker_threads), velocity(0.0f,0.0f,0.0f), memory(0), loaded_cells(0), loads_in_flight(0), bytes_in_flight(0), stalls(0), stall_time(0.0), last_upload_time(0.0) {
+	queue = new WorldQueue ();
+	pthread_mutex_init (&queue->mutex, NULL);
+	pthread_cond_init (&queue->condition, NULL);
+	queue->quit = false;
+}
+WorldStreamer::~WorldStreamer () {
+	pthread_mutex_lock (&queue->mutex);
+	queue->quit = true;
+	pthread_cond_broadcast (&queue->condition);
+	pthread_mutex_unlock (&queue->mutex);
+	for (int i=0; i<queue->threads.count(); i++)
+		pthread_join (queue->threads[i], NULL);
+	for (int i=0; i<queue->pending.count(); i++)
+		delete_load (queue->pending[i]);
+	for (int i=0; i<queue->done.count(); i++)
+		delete_load (queue->done[i]);
+	pthread_mutex_destroy (&queue->mutex);
+	pthread_cond_destroy (&queue->condition);
+	delete queue;
+	for (int i=0; i<cells.count(); i++) {
+		if (cells[i]->state == WorldCell::LOADED)
+			unload (cells[i]);
+		delete cells[i];
+	}
+}
+
+WorldCell* WorldStreamer::get_cell (int x, int z, bool create) {
+	for (int i=0; i<cells.count(); i++) {
+		if (cells[i]->x == x && cells[i]->z == z)
+			return cells[i];
+	}
+	if (!create)
+		return NULL;
+	WorldCell* cell = new WorldCell ();
+	cell->x = x;
+	cell->z = z;
+	cell->state = WorldCell::UNLOADED;
+	cell->file_size = 0;
+	cell->memory = 0;
+	cell->load = NULL;
+	cell->latency = 0.0;
+	cell->read_time = 0.0;
+	cell->decode_time = 0.0;
+	cell->upload_time = 0.0;
+	cell->load_count = 0;
+	cells.append (cell);
+	return cell;
+}
+// the distance from position to the square of the cell on the xz plane
+float WorldStreamer::get_distance (const WorldCell* cell, const vec3& position) {
+	float min_x = cell->x * cell_size;
+	float min_z = cell->z * cell_size;
+	float dx = position.x < min_x ? min_x - position.x : (position.x > min_x + cell_size ? position.x - min_x - cell_size : 0.0f);
+	float dz = position.z < min_z ? min_z - position.z : (position.z > min_z + cell_size ? position.z - min_z - cell_size : 0.0f);
+	return sqrt (dx*dx + dz*dz);
+}
+
+void WorldStreamer::add (const char* filename, const vec3& position, float rotation) {
+	WorldCell* cell = get_cell ((int)floor(position.x / cell_size), (int)floor(position.z / cell_size), true);
+	WorldAsset asset;
+	strncpy (asset.filename, filename, sizeof(asset.filename)-1);
+	asset.filename[sizeof(asset.filename)-1] = '\0';
+	asset.position = position;
+	asset.rotation = rotation;
+	cell->assets.append (asset);
+	// the first load is budgeted with the file size
+	struct stat s;
+	if (stat(filename, &s) == 0) {
+		cell->file_size += s.st_size;
+		if (cell->load_count == 0)
+			cell->memory = cell->file_size;
+	}
+	else
+		fprintf (stderr, "WorldStreamer::add: %s does not exist\n", filename);
+}
+bool WorldStreamer::load (const char* filename) {
+	FILE* file = fopen (filename, "r");
+	if (!file) {
+		fprintf (stderr, "WorldStreamer::load: failed to open %s\n", filename);
+		return false;
+	}
+	char line[512];
+	int line_number = 0;
+	while (fgets(line, sizeof(line), file)) {
+		line_number++;
+		char keyword[32];
+		if (sscanf(line, "%31s", keyword) != 1 || keyword[0] == '#')
+			continue;
+		if (strcmp(keyword, "object") == 0) {
+			char object_file[256];
+			vec3 position;
+			float rotation = 0.0f;
+			int n = sscanf (line, "%*s %255s %f %f %f %f", object_file, &position.x, &position.y, &position.z, &rotation);
+			if (n >= 4)
+				add (object_file, position, rotation);
+			else
+				fprintf (stderr, "WorldStreamer::load: %s:%d: invalid object\n", filename, line_number);
+		}
+		else
+			fprintf (stderr, "WorldStreamer::load: %s:%d: unknown setting %s\n", filename, line_number, keyword);
+	}
+	fclose (file);
+	printf ("WorldStreamer::load: %d cells\n", cells.count());
+	return true;
+}
+
+void WorldStreamer::request (WorldCell* cell) {
+	WorldLoad* load = new WorldLoad ();
+	load->cell = cell;
+	for (int i=0; i<cell->assets.count(); i++) {
+		const char* filename = cell->assets[i].filename;
+		bool found = false;
+		for (int j=0; j<load->filenames.count() && !found; j++)
+			found = strcmp (load->filenames[j], filename) == 0;
+		if (!found)
+			load->filenames.append (filename);
+	}
+	load->request_time = get_milliseconds ();
+	load->read_time = 0.0;
+	load->decode_time = 0.0;
+	cell->load = load;
+	cell->state = WorldCell::LOADING;
+	loads_in_flight++;
+	bytes_in_flight += cell->file_size;
+	
+	pthread_mutex_lock (&queue->mutex);
+	while (queue->threads.count() < worker_threads) {
+		pthread_t thread;
+		if (pthread_create(&thread, NULL, world_worker, queue) != 0)
+			break;
+		queue->threads.append (thread);
+	}
+	queue->pending.append (load);
+	pthread_cond_signal (&queue->condition);
+	pthread_mutex_unlock (&queue->mutex);
+}
+// creates the objects and instances of a cell whose files were imported
+void WorldStreamer::finish (WorldCell* cell) {
+	WorldLoad* load = cell->load;
+	double start = get_milliseconds ();
+	size_t before = ResourceManager::get_total ();
+	for (int i=0; i<load->scenes.count(); i++)
+		cell->objects.append (load->scenes[i] ? new Object(load->scenes[i], false, &load->images) : NULL);
+	for (int i=0; i<cell->assets.count(); i++) {
+		const WorldAsset& asset = cell->assets[i];
+		for (int j=0; j<load->filenames.count(); j++) {
+			if (strcmp(load->filenames[j], asset.filename) != 0 || !cell->objects[j])
+				continue;
+			mat4 transform = mat4::translation (asset.position) * mat4::rotation (asset.rotation, vec3(0.0f, 1.0f, 0.0f));
+			cell->handles.append (scene->store.add(cell->objects[j], transform));
+			break;
+		}
+	}
+	size_t after = ResourceManager::get_total ();
+	cell->memory = after > before ? after - before : 0;
+	double end = get_milliseconds ();
+	cell->latency = end - load->request_time;
+	cell->read_time = load->read_time;
+	cell->decode_time = load->decode_time;
+	cell->upload_time = end - start;
+	cell->load_count++;
+	cell->state = WorldCell::LOADED;
+	cell->load = NULL;
+	memory += cell->memory;
+	loaded_cells++;
+	loads_in_flight--;
+	bytes_in_flight -= cell->file_size;
+	delete_load (load);
+}
+void WorldStreamer::unload (WorldCell* cell) {
+	for (int i=0; i<cell->handles.count(); i++)
+		scene->store.remove (cell->handles[i]);
+	cell->handles.clear ();
+	for (int i=0; i<cell->objects.count(); i++)
+		delete cell->objects[i];
+	cell->objects.clear ();
+	cell->state = WorldCell::UNLOADED;
+	memory -= cell->memory;
+	loaded_cells--;
+}
+
+void WorldStreamer::update (const Camera* camera) {
+	double now = get_milliseconds ();
+	vec3 position = camera->position;
+	if (last_time > 0.0 && now > last_time) {
+		vec3 current = (position - last_position) * (float)(1000.0 / (now - last_time));
+		velocity = velocity * 0.8f + current * 0.2f;
+	}
+	last_position = position;
+	last_time = now;
+	
+	// the cells whose files are ready
+	pthread_mutex_lock (&queue->mutex);
+	List<WorldLoad*> done = queue->done;
+	queue->done.clear ();
+	pthread_mutex_unlock (&queue->mutex);
+	for (int i=0; i<done.count(); i++)
+		finish (done[i]->cell);
+	last_upload_time = get_milliseconds() - now;
+	
+	// unload the cells that are far away and collect the ones to load, both
+	// around the camera and around where it will be prefetch_time from now
+	vec3 ahead = position + velocity * prefetch_time;
+	List<CellCandidate> candidates;
+	size_t reserved = memory;
+	for (int i=0; i<cells.count(); i++) {
+		WorldCell* cell = cells[i];
+		float distance = get_distance (cell, position);
+		float distance_ahead = get_distance (cell, ahead);
+		float nearest = distance < distance_ahead ? distance : distance_ahead;
+		if (cell->state == WorldCell::LOADED) {
+			if (nearest > unload_distance)
+				unload (cell);
+		}
+		else if (cell->state == WorldCell::LOADING) {
+			// a load that has not started yet can still be cancelled
+			if (nearest > unload_distance) {
+				pthread_mutex_lock (&queue->mutex);
+				for (int j=0; j<queue->pending.count(); j++) {
+					if (queue->pending[j] == cell->load) {
+						queue->pending.remove (j);
+						delete_load (cell->load);
+						cell->load = NULL;
+						cell->state = WorldCell::UNLOADED;
+						loads_in_flight--;
+						bytes_in_flight -= cell->file_size;
+						break;
+					}
+				}
+				pthread_mutex_unlock (&queue->mutex);
+			}
+			if (cell->state == WorldCell::LOADING)
+				reserved += cell->memory;
+		}
+		else if (nearest < load_distance) {
+			CellCandidate candidate = {cell, nearest};
+			candidates.append (candidate);
+		}
+	}
+	
+	candidates.sort (CloserCell());
+	for (int i=0; i<candidates.count(); i++) {
+		WorldCell* cell = candidates[i].cell;
+		if (loads_in_flight >= max_loads)
+			break;
+		// at least one load, even if the cell alone exceeds the budget
+		if (io_budget > 0 && bytes_in_flight > 0 && bytes_in_flight + cell->file_size > io_budget)
+			break;
+		// make room by unloading loaded cells that are farther away than this one
+		while (memory_budget > 0 && reserved + cell->memory > memory_budget) {
+			WorldCell* farthest = NULL;
+			float farthest_distance = candidates[i].distance;
+			for (int j=0; j<cells.count(); j++) {
+				if (cells[j]->state != WorldCell::LOADED)
+					continue;
+				float distance = get_distance (cells[j], position);
+				if (distance > farthest_distance) {
+					farthest = cells[j];
+					farthest_distance = distance;
+				}
+			}
+			if (!farthest)
+				break;
+			reserved -= farthest->memory;
+			unload (farthest);
+		}
+		if (memory_budget > 0 && reserved + cell->memory > memory_budget)
+			break;
+		reserved += cell->memory;
+		request (cell);
+	}
+	
+	// a stall is a frame in which the cell under the camera is missing
+	WorldCell* current = get_cell ((int)floor(position.x / cell_size), (int)floor(position.z / cell_size), false);
+	bool stall = current && current->state != WorldCell::LOADED;
+	if (stall) {
+		stalls++;
+		if (!stalled)
+			stall_start = now;
+	}
+	else if (stalled)
+		stall_time += now - stall_start;
+	stalled = stall;
+}
+
+void WorldStreamer::print_statistics () {
+	printf ("WorldStreamer: %d of %d cells loaded, %.1f MB", loaded_cells, cells.count(), memory / (1024.0 * 1024.0));
+	if (memory_budget > 0)
+		printf (" of %.1f MB", memory_budget / (1024.0 * 1024.0));
+	printf (", %d loads in flight (%.1f MB)\n", loads_in_flight, bytes_in_flight / (1024.0 * 1024.0));
+	printf ("WorldStreamer: %d stalled frames, %.1f ms stalled, %.2f ms upload during the last update\n", stalls, stall_time + (stalled ? get_milliseconds() - stall_start : 0.0), last_upload_time);
+	double total = 0.0;
+	double max = 0.0;
+	int count = 0;
+	for (int i=0; i<cells.count(); i++) {
+		const WorldCell* cell = cells[i];
+		if (cell->load_count == 0)
+			continue;
+		printf ("  cell %d,%d: %d assets, loaded %d times, latency %.1f ms (read %.1f ms, decode %.1f ms, upload %.1f ms), %.1f MB\n", cell->x, cell->z, cell->assets.count(), cell->load_count, cell->latency, cell->read_time, cell->decode_time, cell->upload_time, cell->memory / (1024.0 * 1024.0));
+		total += cell->latency;
+		if (cell->latency > max)
+			max = cell->latency;
+		count++;
+	}
+	if (count > 0)
+		printf ("WorldStreamer: latency %.1f ms average, %.1f ms max\n", total / count, max);
+}
+
+}